@@ -75,3 +75,6 @@ else()
     endif()
   endif()
 endif()
+
+# Some components run work on background threads
+find_package(Threads REQUIRED)
@@ -4,19 +4,21 @@ get_filename_component(
 )
 
 # Define all the individual components that cudawrappers provides
-set(CUDAWRAPPERS_COMPONENTS cu cufft nvml nvrtc nvtx)
+set(CUDAWRAPPERS_COMPONENTS cu cufft metrics nvml nvrtc nvtx)
 if(${CUDAWRAPPERS_BACKEND_HIP})
   list(APPEND CUDAWRAPPERS_COMPONENTS macros)
   set(LINK_macros hip::host)
   set(LINK_cu hip::host)
   set(LINK_cufft hip::host hip::hipfft)
-  set(LINK_nvml hip::host)
+  set(LINK_metrics hip::host Threads::Threads)
+  set(LINK_nvml hip::host Threads::Threads)
   set(LINK_nvrtc hip::host)
   set(LINK_nvtx hip::host)
 else()
   set(LINK_cu CUDA::cuda_driver)
   set(LINK_cufft CUDA::cuda_driver CUDA::cufft)
-  set(LINK_nvml CUDA::cuda_driver CUDA::nvml)
+  set(LINK_metrics CUDA::cuda_driver CUDA::nvml Threads::Threads)
+  set(LINK_nvml CUDA::cuda_driver CUDA::nvml Threads::Threads)
   set(LINK_nvrtc CUDA::cuda_driver CUDA::nvrtc)
   set(LINK_nvtx CUDA::nvToolsExt)
 endif()
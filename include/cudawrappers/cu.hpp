@@ -1,15 +1,34 @@
 #if !defined CU_WRAPPER_H
 #define CU_WRAPPER_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <exception>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iomanip>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -23,6 +42,23 @@
 #include <cudawrappers/macros.hpp>
 #endif
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Non-temporal copies use intrinsics with runtime dispatch, which nvcc does
+// not support in host code
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__CUDACC__)
+#define CUDAWRAPPERS_HAVE_NT_COPY
+#include <immintrin.h>
+#endif
+
 namespace cu {
 class Error : public std::exception {
  public:
@@ -53,6 +89,531 @@ inline int driverGetVersion() {
   return version;
 }
 
+// Process-wide counters of the resources and work that go through the
+// wrappers. They are updated with relaxed atomic operations, such that they
+// can be sampled at any time without locking.
+struct Counters {
+  std::atomic<uint64_t> deviceAllocations{0};
+  std::atomic<uint64_t> deviceBytes{0};  // currently allocated
+  std::atomic<uint64_t> hostAllocations{0};
+  std::atomic<uint64_t> hostBytes{0};  // currently allocated or registered
+  std::atomic<uint64_t> bytesCopiedHtoD{0};
+  std::atomic<uint64_t> bytesCopiedDtoH{0};
+  std::atomic<uint64_t> bytesCopiedDtoD{0};
+  std::atomic<uint64_t> bytesCopiedHtoH{0};
+  std::atomic<uint64_t> kernelLaunches{0};
+  std::atomic<uint64_t> synchronizations{0};
+  std::atomic<uint64_t> synchronizeNanoseconds{0};  // time spent waiting
+  // Allocations of a cacheable size served from a cache, or by the driver
+  std::atomic<uint64_t> poolHits{0};
+  std::atomic<uint64_t> poolMisses{0};
+  // Frees that were queued by the release policy, and the bytes they hold
+  std::atomic<uint64_t> deferredReleases{0};
+  std::atomic<uint64_t> deferredBytes{0};
+  // Stream waits inserted by hazard tracking, see setHazardTracking()
+  std::atomic<uint64_t> hazardWaits{0};
+};
+
+inline Counters &getCounters() {
+  static Counters counters;
+  return counters;
+}
+
+namespace detail {
+inline void count(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void uncount(std::atomic<uint64_t> &counter, uint64_t value) {
+  counter.fetch_sub(value, std::memory_order_relaxed);
+}
+
+// Call a function that waits for the device, counting the time it waits
+template <typename F>
+void countSynchronize(F wait) {
+  const auto start = std::chrono::steady_clock::now();
+  wait();
+  const auto duration = std::chrono::steady_clock::now() - start;
+  count(getCounters().synchronizations);
+  count(getCounters().synchronizeNanoseconds,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+// Remembers which host ranges are pageable, i.e. not allocated or registered
+// through the driver, such that the driver is queried only once per range.
+// HostMemory invalidates the ranges it allocates and registers. A stale entry
+// only affects performance: the driver accepts both kinds of host memory.
+class HostRangeCache {
+ public:
+  bool isPageable(const void *ptr, size_t size) {
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(ptr);
+    const uintptr_t end = begin + size;
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (contains(_registered, begin, end)) {
+      return false;
+    } else if (contains(_pageable, begin, end)) {
+      return true;
+    }
+
+    CUmemorytype memoryType;
+    const CUdeviceptr devPtr =
+        reinterpret_cast<CUdeviceptr>(const_cast<void *>(ptr));
+    if (cuPointerGetAttribute(&memoryType, CU_POINTER_ATTRIBUTE_MEMORY_TYPE,
+                              devPtr) != CUDA_SUCCESS) {
+      insert(_pageable, begin, end);
+      return true;
+    }
+    CUdeviceptr start;
+    size_t rangeSize;
+    if (cuPointerGetAttribute(&start, CU_POINTER_ATTRIBUTE_RANGE_START_ADDR,
+                              devPtr) == CUDA_SUCCESS &&
+        cuPointerGetAttribute(&rangeSize, CU_POINTER_ATTRIBUTE_RANGE_SIZE,
+                              devPtr) == CUDA_SUCCESS) {
+      const char *startPtr = reinterpret_cast<char *>(start);
+      insert(_registered, reinterpret_cast<uintptr_t>(startPtr),
+             reinterpret_cast<uintptr_t>(startPtr + rangeSize));
+    } else {
+      insert(_registered, begin, end);
+    }
+    return false;
+  }
+
+  void invalidate(const void *ptr, size_t size) {
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(ptr);
+    const uintptr_t end = begin + size;
+    std::lock_guard<std::mutex> lock(_mutex);
+    erase(_registered, begin, end);
+    erase(_pageable, begin, end);
+  }
+
+ private:
+  using Ranges = std::map<uintptr_t, uintptr_t>;  // begin -> end
+
+  static bool contains(const Ranges &ranges, uintptr_t begin, uintptr_t end) {
+    auto range = ranges.upper_bound(begin);
+    return range != ranges.begin() && end <= (--range)->second;
+  }
+
+  static void insert(Ranges &ranges, uintptr_t begin, uintptr_t end) {
+    const size_t maxRanges = 4096;
+    if (ranges.size() >= maxRanges) {
+      ranges.clear();
+    }
+    uintptr_t &rangeEnd = ranges[begin];
+    rangeEnd = std::max(rangeEnd, end);
+  }
+
+  static void erase(Ranges &ranges, uintptr_t begin, uintptr_t end) {
+    auto range = ranges.upper_bound(begin);
+    if (range != ranges.begin() && std::prev(range)->second > begin) {
+      range--;
+    }
+    while (range != ranges.end() && range->first < end) {
+      range = ranges.erase(range);
+    }
+  }
+
+  std::mutex _mutex;
+  Ranges _registered;
+  Ranges _pageable;
+};
+
+inline HostRangeCache &getHostRangeCache() {
+  static HostRangeCache cache;
+  return cache;
+}
+}  // namespace detail
+
+// When the memory of DeviceMemory, HostMemory and Array objects is freed,
+// see setReleasePolicy()
+enum class ReleasePolicy {
+  Immediate,   // when the last reference is destroyed
+  Deferred,    // at the next call to releaseDeferred()
+  Background,  // as soon as possible, by a background thread
+};
+
+namespace detail {
+// Queues the driver calls that free memory, which may synchronize the device
+// (e.g. cuMemFree), such that they do not stall the thread that destroys the
+// last reference. A queued call is made in the context that was current when
+// it was queued.
+class ReleaseQueue {
+ public:
+  ~ReleaseQueue() { stopThread(); }
+
+  void setPolicy(ReleasePolicy policy) {
+    if (policy != ReleasePolicy::Background) {
+      stopThread();
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _policy = policy;
+    }
+    if (policy == ReleasePolicy::Background && !_thread.joinable()) {
+      _thread = std::thread(&ReleaseQueue::loop, this);
+    } else if (policy == ReleasePolicy::Immediate) {
+      flush();
+    }
+  }
+
+  ReleasePolicy getPolicy() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _policy;
+  }
+
+  void release(size_t bytes, std::function<void()> function) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_policy == ReleasePolicy::Immediate) {
+      lock.unlock();
+      function();
+      return;
+    }
+    CUcontext context{};
+    if (cuCtxGetCurrent(&context) != CUDA_SUCCESS) {
+      // The call could not be made in the right context later, and this may
+      // run in a destructor, so do not throw
+      lock.unlock();
+      function();
+      return;
+    }
+    _entries.push_back({context, bytes, std::move(function)});
+    count(getCounters().deferredReleases);
+    count(getCounters().deferredBytes, bytes);
+    lock.unlock();
+    _condition.notify_one();
+  }
+
+  void flush() {
+    std::vector<Entry> entries;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      entries.swap(_entries);
+    }
+    for (Entry &entry : entries) {
+      run(entry);
+    }
+  }
+
+ private:
+  struct Entry {
+    CUcontext context;
+    size_t bytes;
+    std::function<void()> function;
+  };
+
+  static void run(Entry &entry) {
+    if (entry.context) {
+      checkCudaCall(cuCtxPushCurrent(entry.context));
+    }
+    try {
+      entry.function();
+    } catch (...) {
+      finish(entry);
+      throw;
+    }
+    finish(entry);
+  }
+
+  static void finish(Entry &entry) {
+    uncount(getCounters().deferredBytes, entry.bytes);
+    if (entry.context) {
+      CUcontext context;
+      checkCudaCall(cuCtxPopCurrent(&context));
+    }
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stop) {
+      _condition.wait(lock, [&] { return _stop || !_entries.empty(); });
+      std::vector<Entry> entries;
+      entries.swap(_entries);
+      lock.unlock();
+      for (Entry &entry : entries) {
+        try {
+          run(entry);
+        } catch (const Error &) {
+          // There is no caller to report the error to
+        }
+      }
+      lock.lock();
+    }
+  }
+
+  void stopThread() {
+    if (!_thread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _condition.notify_one();
+    _thread.join();
+    _stop = false;
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  std::vector<Entry> _entries;
+  ReleasePolicy _policy{ReleasePolicy::Immediate};
+  bool _stop{false};
+  std::thread _thread;
+};
+
+inline ReleaseQueue &getReleaseQueue() {
+  static ReleaseQueue queue;
+  return queue;
+}
+
+inline void release(size_t bytes, std::function<void()> function) {
+  getReleaseQueue().release(bytes, std::move(function));
+}
+}  // namespace detail
+
+// Set when memory is freed. Deferred releases are made in the context that
+// was current when the memory was released, so releaseDeferred() should be
+// called before that context is destroyed.
+inline void setReleasePolicy(ReleasePolicy policy) {
+  detail::getReleaseQueue().setPolicy(policy);
+}
+
+inline ReleasePolicy getReleasePolicy() {
+  return detail::getReleaseQueue().getPolicy();
+}
+
+// Make the releases that were deferred, e.g. at a point where the device is
+// idle anyway
+inline void releaseDeferred() { detail::getReleaseQueue().flush(); }
+
+// The kinds of memory that are accounted, see setMemoryAccounting()
+enum class MemoryKind { Device, Managed, Host, Array, Async };
+
+struct MemoryUsage {
+  int device;  // ordinal, -1 for host memory
+  MemoryKind kind;
+  std::string tag;
+  uint64_t totalAllocations;
+  uint64_t allocations;  // current
+  uint64_t peakAllocations;
+  uint64_t bytes;  // current
+  uint64_t peakBytes;
+};
+
+namespace detail {
+// Counts the memory per device, kind and tag. The counters of a device are
+// created when it first allocates memory and are only updated with atomic
+// operations afterwards; only registering a tag takes a lock.
+class MemoryAccounting {
+ public:
+  static const size_t maxDevices = 64;  // including the host
+  static const size_t maxTags = 64;
+  static const size_t kinds = 5;
+
+  struct Slot {
+    std::atomic<uint64_t> totalAllocations{0};
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> peakAllocations{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> peakBytes{0};
+  };
+
+  MemoryAccounting() { _tags[0] = ""; }
+
+  ~MemoryAccounting() {
+    for (std::atomic<Block *> &block : _blocks) {
+      delete block.load();
+    }
+  }
+
+  Slot *allocate(int device, MemoryKind kind, size_t tag, uint64_t bytes) {
+    Slot &slot = getSlot(device, kind, tag);
+    count(slot.totalAllocations);
+    raise(slot.peakAllocations,
+          slot.allocations.fetch_add(1, std::memory_order_relaxed) + 1);
+    raise(slot.peakBytes,
+          slot.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    return &slot;
+  }
+
+  static void free(Slot *slot, uint64_t bytes) {
+    uncount(slot->allocations, 1);
+    uncount(slot->bytes, bytes);
+  }
+
+  size_t registerTag(const std::string &name) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t tag = 0; tag < _tagCount; tag++) {
+      if (_tags[tag] == name) {
+        return tag;
+      }
+    }
+    if (_tagCount == maxTags) {
+      throw std::length_error("MemoryAccounting: too many tags");
+    }
+    _tags[_tagCount] = name;
+    return _tagCount++;
+  }
+
+  // The counters of every device, kind and tag that ever allocated memory
+  std::vector<MemoryUsage> getUsage() {
+    std::vector<std::string> tags;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      tags.assign(_tags.begin(), _tags.begin() + _tagCount);
+    }
+    std::vector<MemoryUsage> usage;
+    for (size_t index = 0; index < maxDevices; index++) {
+      Block *block = _blocks[index].load(std::memory_order_acquire);
+      for (size_t kind = 0; block && kind < kinds; kind++) {
+        for (size_t tag = 0; tag < tags.size(); tag++) {
+          const Slot &slot = (*block)[kind * maxTags + tag];
+          if (slot.totalAllocations == 0) {
+            continue;
+          }
+          usage.push_back({static_cast<int>(index) - 1,
+                           static_cast<MemoryKind>(kind), tags[tag],
+                           slot.totalAllocations, slot.allocations,
+                           slot.peakAllocations, slot.bytes, slot.peakBytes});
+        }
+      }
+    }
+    return usage;
+  }
+
+  void resetPeaks() {
+    for (std::atomic<Block *> &block : _blocks) {
+      Block *slots = block.load(std::memory_order_acquire);
+      for (size_t i = 0; slots && i < slots->size(); i++) {
+        Slot &slot = (*slots)[i];
+        slot.peakAllocations.store(slot.allocations);
+        slot.peakBytes.store(slot.bytes);
+      }
+    }
+  }
+
+ private:
+  using Block = std::array<Slot, kinds * maxTags>;
+
+  static void raise(std::atomic<uint64_t> &peak, uint64_t value) {
+    uint64_t current = peak.load(std::memory_order_relaxed);
+    while (value > current &&
+           !peak.compare_exchange_weak(current, value,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+
+  // Block 0 counts host memory, devices beyond the last block share it
+  Slot &getSlot(int device, MemoryKind kind, size_t tag) {
+    const size_t index = std::min<size_t>(device + 1, maxDevices - 1);
+    Block *block = _blocks[index].load(std::memory_order_acquire);
+    if (!block) {
+      Block *created = new Block();
+      if (_blocks[index].compare_exchange_strong(block, created,
+                                                 std::memory_order_acq_rel)) {
+        block = created;
+      } else {
+        delete created;  // another thread was first, block is its block
+      }
+    }
+    return (*block)[static_cast<size_t>(kind) * maxTags + tag];
+  }
+
+  std::array<std::atomic<Block *>, maxDevices> _blocks{};
+  std::mutex _mutex;
+  std::array<std::string, maxTags> _tags;
+  size_t _tagCount{1};  // tag 0 is the empty tag
+};
+
+inline std::atomic<bool> &getMemoryAccountingEnabled() {
+  static std::atomic<bool> enabled{false};
+  return enabled;
+}
+
+inline MemoryAccounting &getMemoryAccounting() {
+  static MemoryAccounting accounting;
+  return accounting;
+}
+
+inline size_t &getMemoryTag() {
+  static thread_local size_t tag = 0;
+  return tag;
+}
+
+// Account an allocation in the current context, returns what to pass to
+// unaccount() when it is freed
+inline MemoryAccounting::Slot *account(MemoryKind kind, uint64_t bytes) {
+  if (!getMemoryAccountingEnabled().load(std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  int device = -1;
+  if (kind != MemoryKind::Host) {
+    CUdevice handle;
+    checkCudaCall(cuCtxGetDevice(&handle));
+    device = handle;
+  }
+  return getMemoryAccounting().allocate(device, kind, getMemoryTag(), bytes);
+}
+
+inline void unaccount(MemoryAccounting::Slot *slot, uint64_t bytes) {
+  if (slot) {
+    MemoryAccounting::free(slot, bytes);
+  }
+}
+}  // namespace detail
+
+// Count the memory that is allocated through the wrappers per device, kind
+// and tag. Memory that was allocated while accounting was disabled is not
+// counted when it is freed either.
+inline void setMemoryAccounting(bool enabled) {
+  detail::getMemoryAccountingEnabled().store(enabled);
+}
+
+// Attributes the memory that the calling thread allocates to a tag, for as
+// long as the MemoryTag exists, e.g. MemoryTag tag("fft");
+class MemoryTag {
+ public:
+  explicit MemoryTag(const std::string &tag)
+      : _previous(detail::getMemoryTag()) {
+    detail::getMemoryTag() = detail::getMemoryAccounting().registerTag(tag);
+  }
+
+  MemoryTag(const MemoryTag &) = delete;
+  MemoryTag &operator=(const MemoryTag &) = delete;
+
+  ~MemoryTag() { detail::getMemoryTag() = _previous; }
+
+ private:
+  size_t _previous;
+};
+
+inline std::vector<MemoryUsage> getMemoryUsage() {
+  return detail::getMemoryAccounting().getUsage();
+}
+
+// Start the peaks over from the current values, e.g. per phase of a program
+inline void resetMemoryPeaks() { detail::getMemoryAccounting().resetPeaks(); }
+
+inline void dumpMemoryUsage(std::ostream &out) {
+  static const char *kindNames[] = {"device", "managed", "host", "array",
+                                    "async"};
+  out << std::left << std::setw(8) << "device" << std::setw(9) << "kind"
+      << std::setw(16) << "tag" << std::right << std::setw(12) << "total"
+      << std::setw(12) << "allocs" << std::setw(12) << "peak" << std::setw(16)
+      << "bytes" << std::setw(16) << "peak" << '\n';
+  for (const MemoryUsage &usage : getMemoryUsage()) {
+    out << std::left << std::setw(8)
+        << (usage.device < 0 ? std::string("host")
+                             : std::to_string(usage.device))
+        << std::setw(9) << kindNames[static_cast<size_t>(usage.kind)]
+        << std::setw(16) << (usage.tag.empty() ? "-" : usage.tag) << std::right
+        << std::setw(12) << usage.totalAllocations << std::setw(12)
+        << usage.allocations << std::setw(12) << usage.peakAllocations
+        << std::setw(16) << usage.bytes << std::setw(16) << usage.peakBytes
+        << '\n';
+  }
+}
+
 inline void memcpyHtoD(CUdeviceptr dst, const void *src, size_t size) {
 #if defined(__HIP__)
   // const_cast is a temp fix for https://github.com/ROCm/ROCm/issues/2977
@@ -60,10 +621,12 @@ inline void memcpyHtoD(CUdeviceptr dst, const void *src, size_t size) {
 #else
   checkCudaCall(cuMemcpyHtoD(dst, src, size));
 #endif
+  detail::count(getCounters().bytesCopiedHtoD, size);
 }
 
 inline void memcpyDtoH(void *dst, CUdeviceptr src, size_t size) {
   checkCudaCall(cuMemcpyDtoH(dst, src, size));
+  detail::count(getCounters().bytesCopiedDtoH, size);
 }
 
 class Context;
@@ -185,6 +748,22 @@ class Device : public Wrapper<CUdevice> {
     return result.str();
   }
 
+  std::string getPciBusId() const {
+    const size_t max_bus_id_length{16};
+    std::array<char, max_bus_id_length> busId{};
+    checkCudaCall(cuDeviceGetPCIBusId(busId.data(), busId.size(), _obj));
+    std::string result(busId.data());
+    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+    return result;
+  }
+
+  // NUMA node the device is attached to, or -1 if unknown
+  int getNumaNode() const {
+    std::ifstream file("/sys/bus/pci/devices/" + getPciBusId() + "/numa_node");
+    int node = -1;
+    return file >> node ? node : -1;
+  }
+
   std::string getArch() const {
 #if defined(__HIP_PLATFORM_AMD__)
     hipDeviceProp_t prop;
@@ -239,6 +818,12 @@ class Device : public Wrapper<CUdevice> {
   int _ordinal;
 };
 
+namespace detail {
+// Forget the blocks that the allocators cached for a context that is
+// destroyed, see BlockCache
+inline void dropCachedBlocks(CUcontext context);
+}  // namespace detail
+
 class Context : public Wrapper<CUcontext> {
  public:
   // Context Management
@@ -250,7 +835,10 @@ class Context : public Wrapper<CUcontext> {
     checkCudaCall(cuCtxCreate(&_obj, flags, device));
     manager =
         std::shared_ptr<CUcontext>(new CUcontext(_obj), [](CUcontext *ptr) {
-          if (*ptr) cuCtxDestroy(*ptr);
+          if (*ptr) {
+            detail::dropCachedBlocks(*ptr);
+            cuCtxDestroy(*ptr);
+          }
           delete ptr;
         });
 #endif
@@ -352,7 +940,7 @@ class Context : public Wrapper<CUcontext> {
 
   static void synchronize() {
 #if !defined(__HIP__)
-    checkCudaCall(cuCtxSynchronize());
+    detail::countSynchronize([] { checkCudaCall(cuCtxSynchronize()); });
 #endif
   }
 
@@ -369,19 +957,144 @@ class HostMemory : public Wrapper<void *> {
  public:
   explicit HostMemory(size_t size, unsigned int flags = 0) : _size(size) {
     checkCudaCall(cuMemHostAlloc(&_obj, size, flags));
-    manager = std::shared_ptr<void *>(new (void *)(_obj), [](void **ptr) {
-      checkCudaCall(cuMemFreeHost(*ptr));
-      delete ptr;
-    });
+    detail::count(getCounters().hostAllocations);
+    detail::count(getCounters().hostBytes, size);
+    detail::getHostRangeCache().invalidate(_obj, size);
+    auto account = detail::account(MemoryKind::Host, size);
+    manager = std::shared_ptr<void *>(
+        new (void *)(_obj), [size, account](void **ptr) {
+          void *hostPtr = *ptr;
+          detail::release(size, [hostPtr, size, account] {
+            detail::getHostRangeCache().invalidate(hostPtr, size);
+            checkCudaCall(cuMemFreeHost(hostPtr));
+            detail::uncount(getCounters().hostBytes, size);
+            detail::unaccount(account, size);
+          });
+          delete ptr;
+        });
   }
 
   explicit HostMemory(void *ptr, size_t size, unsigned int flags = 0)
       : _size(size) {
     _obj = ptr;
     checkCudaCall(cuMemHostRegister(_obj, size, flags));
-    manager = std::shared_ptr<void *>(new (void *)(_obj), [](void **ptr) {
-      checkCudaCall(cuMemHostUnregister(*ptr));
-    });
+    detail::count(getCounters().hostAllocations);
+    detail::count(getCounters().hostBytes, size);
+    detail::getHostRangeCache().invalidate(_obj, size);
+    auto account = detail::account(MemoryKind::Host, size);
+    // The memory belongs to the caller, who may free or register it again
+    // once this object is destroyed, so it is unregistered immediately,
+    // regardless of the release policy
+    manager = std::shared_ptr<void *>(
+        new (void *)(_obj), [size, account](void **ptr) {
+          detail::getHostRangeCache().invalidate(*ptr, size);
+          checkCudaCall(cuMemHostUnregister(*ptr));
+          detail::uncount(getCounters().hostBytes, size);
+          detail::unaccount(account, size);
+          delete ptr;
+        });
+  }
+
+  struct HugePageReport {
+    bool hugePages;          // false if it fell back to regular pages
+    bool transparent;        // transparent rather than reserved huge pages
+    size_t pageSize;         // bytes
+    double faultSeconds;     // time to fault in the pages
+    double registerSeconds;  // time spent in cuMemHostRegister
+  };
+
+  // Allocates page-locked memory backed by huge pages, which registers
+  // faster and needs fewer TLB entries than regular pages. Reserved huge
+  // pages (MAP_HUGETLB) are used if available, transparent huge pages
+  // otherwise. The pages are optionally bound to a NUMA node and faulted in by
+  // multiple threads before they are registered.
+  static HostMemory allocateHugePages(size_t size, unsigned int flags = 0,
+                                      int numaNode = -1,
+                                      HugePageReport *report = nullptr) {
+    HugePageReport result{};
+#if defined(__linux__)
+    size_t hugePageSize = getHugePageSize();
+    size_t mapSize = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+    void *ptr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    result.hugePages = ptr != MAP_FAILED;
+    if (ptr == MAP_FAILED) {
+      // Only the huge-page-aligned part of a mapping is backed by
+      // transparent huge pages, so map a huge page more than needed, and
+      // trim the mapping to a multiple of huge pages at an aligned address
+      hugePageSize = getTransparentHugePageSize();
+      mapSize = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+      void *mapping = mmap(nullptr, mapSize + hugePageSize,
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+      if (mapping == MAP_FAILED) {
+        throw Error(CUDA_ERROR_OUT_OF_MEMORY);
+      }
+      char *begin = static_cast<char *>(mapping);
+      const size_t head =
+          (hugePageSize - reinterpret_cast<uintptr_t>(begin) % hugePageSize) %
+          hugePageSize;
+      if (head > 0) {
+        munmap(begin, head);
+      }
+      munmap(begin + head + mapSize, hugePageSize - head);
+      ptr = begin + head;
+      result.transparent = result.hugePages =
+          madvise(ptr, mapSize, MADV_HUGEPAGE) == 0 &&
+          hasTransparentHugePages();
+    }
+    result.pageSize =
+        result.hugePages ? hugePageSize : sysconf(_SC_PAGESIZE);
+    if (numaNode >= 0) {
+      bindToNumaNode(ptr, mapSize, numaNode);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    faultPages(static_cast<char *>(ptr), mapSize, result.pageSize);
+    auto end = std::chrono::steady_clock::now();
+    result.faultSeconds = std::chrono::duration<double>(end - start).count();
+
+    start = std::chrono::steady_clock::now();
+    const CUresult registered = cuMemHostRegister(ptr, size, flags);
+    end = std::chrono::steady_clock::now();
+    if (registered != CUDA_SUCCESS) {
+      munmap(ptr, mapSize);
+      throw Error(registered);
+    }
+    result.registerSeconds =
+        std::chrono::duration<double>(end - start).count();
+
+    HostMemory memory;
+    memory._obj = ptr;
+    memory._size = size;
+    detail::count(getCounters().hostAllocations);
+    detail::count(getCounters().hostBytes, size);
+    detail::getHostRangeCache().invalidate(ptr, size);
+    auto account = detail::account(MemoryKind::Host, size);
+    memory.manager = std::shared_ptr<void *>(
+        new (void *)(ptr), [size, mapSize, account](void **ptr) {
+          void *hostPtr = *ptr;
+          detail::release(size, [hostPtr, size, mapSize, account] {
+            detail::getHostRangeCache().invalidate(hostPtr, size);
+            checkCudaCall(cuMemHostUnregister(hostPtr));
+            munmap(hostPtr, mapSize);
+            detail::uncount(getCounters().hostBytes, size);
+            detail::unaccount(account, size);
+          });
+          delete ptr;
+        });
+#else
+    const auto start = std::chrono::steady_clock::now();
+    HostMemory memory(size, flags);
+    result.pageSize = 4096;
+    result.registerSeconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+#endif
+    if (report) {
+      *report = result;
+    }
+    return memory;
   }
 
   template <typename T>
@@ -392,100 +1105,425 @@ class HostMemory : public Wrapper<void *> {
   size_t size() const { return _size; }
 
  private:
-  size_t _size;
-};
-
-class Array : public Wrapper<CUarray> {
- public:
-  Array(unsigned width, CUarray_format format, unsigned numChannels) {
-    create2DArray(width, 0, format, numChannels);
+  HostMemory() : _size(0) {}
+
+#if defined(__linux__)
+  static size_t getHugePageSize() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+      size_t kilobytes;
+      if (std::sscanf(line.c_str(), "Hugepagesize: %zu kB", &kilobytes) == 1) {
+        return kilobytes * 1024;
+      }
+    }
+    return 2 << 20;
   }
 
-  Array(unsigned width, unsigned height, CUarray_format format,
-        unsigned numChannels) {
-    create2DArray(width, height, format, numChannels);
+  // The size of transparent huge pages, which may differ from the default
+  // size of reserved huge pages
+  static size_t getTransparentHugePageSize() {
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+    size_t size = 0;
+    return file >> size && size > 0 ? size : 2 << 20;
   }
 
-  Array(unsigned width, unsigned height, unsigned depth, CUarray_format format,
-        unsigned numChannels) {
-    CUDA_ARRAY3D_DESCRIPTOR descriptor;
-    descriptor.Width = width;
-    descriptor.Height = height;
-    descriptor.Depth = depth;
-    descriptor.Format = format;
-    descriptor.NumChannels = numChannels;
-    descriptor.Flags = 0;
-    checkCudaCall(cuArray3DCreate(&_obj, &descriptor));
-    createManager();
+  static bool hasTransparentHugePages() {
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string mode;
+    std::getline(file, mode);
+    return mode.find("[always]") != std::string::npos ||
+           mode.find("[madvise]") != std::string::npos;
   }
 
-  explicit Array(CUarray &array) : Wrapper(array) {}
-
- private:
-  void create2DArray(unsigned width, unsigned height, CUarray_format format,
-                     unsigned numChannels) {
-    CUDA_ARRAY_DESCRIPTOR descriptor;
-    descriptor.Width = width;
-    descriptor.Height = height;
-    descriptor.Format = format;
-    descriptor.NumChannels = numChannels;
-    checkCudaCall(cuArrayCreate(&_obj, &descriptor));
-    createManager();
+  // Bind with the mbind system call, to not depend on libnuma. This is best
+  // effort: the memory is used as is if binding fails.
+  static void bindToNumaNode(void *ptr, size_t size, int numaNode) {
+    const int bind = 2;  // MPOL_BIND
+    const size_t bitsPerWord = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> nodemask(numaNode / bitsPerWord + 1);
+    nodemask[numaNode / bitsPerWord] |= 1UL << (numaNode % bitsPerWord);
+    syscall(SYS_mbind, ptr, size, bind, nodemask.data(),
+            nodemask.size() * bitsPerWord, 0);
   }
 
-  void createManager() {
-    manager = std::shared_ptr<CUarray>(new CUarray(_obj), [](CUarray *ptr) {
-      checkCudaCall(cuArrayDestroy(*ptr));
-      delete ptr;
-    });
+  static void faultPages(char *ptr, size_t size, size_t pageSize) {
+    const size_t minSizePerThread = 256 << 20;
+    const size_t threads = std::max<size_t>(
+        1, std::min<size_t>(std::thread::hardware_concurrency(),
+                            size / minSizePerThread));
+    const size_t pages = (size + pageSize - 1) / pageSize;
+    const auto fault = [=](size_t thread) {
+      for (size_t page = thread; page < pages; page += threads) {
+        ptr[page * pageSize] = 0;
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t thread = 1; thread < threads; thread++) {
+      workers.emplace_back(fault, thread);
+    }
+    fault(0);
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
   }
+#endif
+
+  size_t _size;
 };
 
-class Module : public Wrapper<CUmodule> {
+namespace detail {
+// Keeps freed blocks of up to maxCachedSize bytes, in power-of-two size
+// classes, to serve later allocations of the same class without a driver
+// call. Larger blocks are allocated and freed directly. A block belongs to
+// the context that was current when it was allocated and is only reused in
+// that context. Once the context is destroyed, which frees the blocks, they
+// are forgotten, see dropCachedBlocks().
+class BlockCache {
  public:
-  explicit Module(const char *file_name) {
-#if defined TEGRA_QUIRKS  // cuModuleLoad broken on Jetson TX1
-    std::ifstream file(file_name);
-    std::string program((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
-    checkCudaCall(cuModuleLoadData(&_obj, program.c_str()));
-#else
-    checkCudaCall(cuModuleLoad(&_obj, file_name));
-#endif
-    manager = std::shared_ptr<CUmodule>(new CUmodule(_obj), [](CUmodule *ptr) {
-      checkCudaCall(cuModuleUnload(*ptr));
-      delete ptr;
-    });
-  }
+  using AllocateFunction = void *(*)(size_t size);
+  // Frees a block, or only uncounts it if its context was destroyed
+  using FreeFunction = void (*)(void *ptr, size_t size, bool destroyed);
 
-  explicit Module(const void *data) {
-    checkCudaCall(cuModuleLoadData(&_obj, data));
-    manager = std::shared_ptr<CUmodule>(new CUmodule(_obj), [](CUmodule *ptr) {
-      checkCudaCall(cuModuleUnload(*ptr));
-      delete ptr;
-    });
-  }
+  static const size_t minCachedSize = 256;
+  static const size_t maxCachedSize = 1 << 20;
 
-  typedef std::map<CUjit_option, void *> optionmap_t;
-  explicit Module(const void *image, Module::optionmap_t &options) {
-    std::vector<CUjit_option> keys;
-    std::vector<void *> values;
+  BlockCache(AllocateFunction allocate, FreeFunction free)
+      : _allocate(allocate), _free(free) {}
 
-    for (const std::pair<CUjit_option, void *> &i : options) {
-      keys.push_back(i.first);
-      values.push_back(i.second);
-    }
+  BlockCache(const BlockCache &) = delete;
+  BlockCache &operator=(const BlockCache &) = delete;
 
-    checkCudaCall(cuModuleLoadDataEx(&_obj, image, options.size(), keys.data(),
-                                     values.data()));
+  ~BlockCache() { release(); }
 
-    for (size_t i = 0; i < keys.size(); ++i) {
-      options[keys[i]] = values[i];
+  void *allocate(size_t size) {
+    if (size > maxCachedSize) {
+      return _allocate(size);
+    }
+    const size_t sizeClass = roundUp(size);
+    CUcontext context{};
+    cuCtxGetCurrent(&context);  // no context is just another key
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto blocks = _blocks.find(std::make_pair(context, sizeClass));
+      if (blocks != _blocks.end() && !blocks->second.empty()) {
+        void *ptr = blocks->second.back();
+        blocks->second.pop_back();
+        count(getCounters().poolHits);
+        return ptr;
+      }
     }
+    count(getCounters().poolMisses);
+    void *ptr = _allocate(sizeClass);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _owners[ptr] = std::make_pair(context, sizeClass);
+    return ptr;
   }
 
-  explicit Module(CUmodule &module) : Wrapper(module) {}
-
+  void deallocate(void *ptr, size_t size) {
+    if (size > maxCachedSize) {
+      _free(ptr, size, false);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto owner = _owners.find(ptr);
+    if (owner != _owners.end()) {  // else its context was destroyed
+      _blocks[owner->second].push_back(ptr);
+    }
+  }
+
+  // Free all cached blocks
+  void release() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (std::pair<const Key, std::vector<void *>> &blocks : _blocks) {
+      for (void *ptr : blocks.second) {
+        _free(ptr, blocks.first.second, false);
+        _owners.erase(ptr);
+      }
+    }
+    _blocks.clear();
+  }
+
+  // Forget the blocks of a context that is destroyed, cached or in use
+  void drop(CUcontext context) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto owner = _owners.begin(); owner != _owners.end();) {
+      if (owner->second.first == context) {
+        _free(owner->first, owner->second.second, true);
+        owner = _owners.erase(owner);
+      } else {
+        owner++;
+      }
+    }
+    for (auto blocks = _blocks.begin(); blocks != _blocks.end();) {
+      if (blocks->first.first == context) {
+        blocks = _blocks.erase(blocks);
+      } else {
+        blocks++;
+      }
+    }
+  }
+
+ private:
+  using Key = std::pair<CUcontext, size_t>;  // context, size class
+
+  static size_t roundUp(size_t size) {
+    size_t sizeClass = minCachedSize;
+    while (sizeClass < size) {
+      sizeClass <<= 1;
+    }
+    return sizeClass;
+  }
+
+  AllocateFunction _allocate;
+  FreeFunction _free;
+  std::mutex _mutex;
+  std::map<Key, std::vector<void *>> _blocks;
+  std::map<void *, Key> _owners;  // the blocks of a cacheable size
+};
+
+// The cached blocks may outlive the context they were allocated in, hence
+// errors are ignored when they are freed
+inline BlockCache &getPinnedBlockCache() {
+  static BlockCache cache(
+      [](size_t size) {
+        void *ptr;
+        checkCudaCall(cuMemHostAlloc(&ptr, size, CU_MEMHOSTALLOC_PORTABLE));
+        count(getCounters().hostAllocations);
+        count(getCounters().hostBytes, size);
+        getHostRangeCache().invalidate(ptr, size);
+        return ptr;
+      },
+      [](void *ptr, size_t size, bool destroyed) {
+        getHostRangeCache().invalidate(ptr, size);
+        if (!destroyed) {
+          cuMemFreeHost(ptr);
+        }
+        uncount(getCounters().hostBytes, size);
+      });
+  return cache;
+}
+
+inline BlockCache &getManagedBlockCache() {
+  static BlockCache cache(
+      [](size_t size) {
+        CUdeviceptr ptr;
+        checkCudaCall(cuMemAllocManaged(&ptr, size, CU_MEM_ATTACH_GLOBAL));
+        count(getCounters().deviceAllocations);
+        count(getCounters().deviceBytes, size);
+        return reinterpret_cast<void *>(ptr);
+      },
+      [](void *ptr, size_t size, bool destroyed) {
+        if (!destroyed) {
+          cuMemFree(reinterpret_cast<CUdeviceptr>(ptr));
+        }
+        uncount(getCounters().deviceBytes, size);
+      });
+  return cache;
+}
+
+inline void dropCachedBlocks(CUcontext context) {
+  getPinnedBlockCache().drop(context);
+  getManagedBlockCache().drop(context);
+}
+
+template <typename T>
+T *allocateArray(BlockCache &cache, size_t n) {
+  if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+    throw std::bad_alloc();
+  }
+  return static_cast<T *>(cache.allocate(n * sizeof(T)));
+}
+}  // namespace detail
+
+/*
+ * PinnedAllocator and ManagedAllocator
+ *
+ * Standard allocators for page-locked host memory and managed memory, such
+ * that e.g. a std::vector<float, cu::PinnedAllocator<float>> can be copied
+ * asynchronously at full speed. Small allocations are cached, see
+ * releaseCachedMemory().
+ */
+template <typename T>
+class PinnedAllocator {
+ public:
+  using value_type = T;
+
+  PinnedAllocator() = default;
+
+  template <typename U>
+  PinnedAllocator(const PinnedAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return detail::allocateArray<T>(detail::getPinnedBlockCache(), n);
+  }
+
+  void deallocate(T *ptr, size_t n) {
+    detail::getPinnedBlockCache().deallocate(ptr, n * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const PinnedAllocator<T> &, const PinnedAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PinnedAllocator<T> &, const PinnedAllocator<U> &) {
+  return false;
+}
+
+template <typename T>
+class ManagedAllocator {
+ public:
+  using value_type = T;
+
+  ManagedAllocator() = default;
+
+  template <typename U>
+  ManagedAllocator(const ManagedAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return detail::allocateArray<T>(detail::getManagedBlockCache(), n);
+  }
+
+  void deallocate(T *ptr, size_t n) {
+    detail::getManagedBlockCache().deallocate(ptr, n * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const ManagedAllocator<T> &, const ManagedAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const ManagedAllocator<T> &, const ManagedAllocator<U> &) {
+  return false;
+}
+
+// Free the memory that the allocators keep cached, e.g. before the context
+// is destroyed
+inline void releaseCachedMemory() {
+  detail::getPinnedBlockCache().release();
+  detail::getManagedBlockCache().release();
+}
+
+class Array : public Wrapper<CUarray> {
+ public:
+  Array(unsigned width, CUarray_format format, unsigned numChannels) {
+    create2DArray(width, 0, format, numChannels);
+  }
+
+  Array(unsigned width, unsigned height, CUarray_format format,
+        unsigned numChannels) {
+    create2DArray(width, height, format, numChannels);
+  }
+
+  Array(unsigned width, unsigned height, unsigned depth, CUarray_format format,
+        unsigned numChannels) {
+    CUDA_ARRAY3D_DESCRIPTOR descriptor;
+    descriptor.Width = width;
+    descriptor.Height = height;
+    descriptor.Depth = depth;
+    descriptor.Format = format;
+    descriptor.NumChannels = numChannels;
+    descriptor.Flags = 0;
+    checkCudaCall(cuArray3DCreate(&_obj, &descriptor));
+    createManager(static_cast<uint64_t>(width) * std::max(height, 1u) *
+                  std::max(depth, 1u) * numChannels * getFormatSize(format));
+  }
+
+  explicit Array(CUarray &array) : Wrapper(array) {}
+
+ private:
+  void create2DArray(unsigned width, unsigned height, CUarray_format format,
+                     unsigned numChannels) {
+    CUDA_ARRAY_DESCRIPTOR descriptor;
+    descriptor.Width = width;
+    descriptor.Height = height;
+    descriptor.Format = format;
+    descriptor.NumChannels = numChannels;
+    checkCudaCall(cuArrayCreate(&_obj, &descriptor));
+    createManager(static_cast<uint64_t>(width) * std::max(height, 1u) *
+                  numChannels * getFormatSize(format));
+  }
+
+  // The size of an element of a channel, the size of other formats than
+  // these is not accounted exactly
+  static size_t getFormatSize(CUarray_format format) {
+    switch (format) {
+      case CU_AD_FORMAT_UNSIGNED_INT8:
+      case CU_AD_FORMAT_SIGNED_INT8:
+        return 1;
+      case CU_AD_FORMAT_UNSIGNED_INT16:
+      case CU_AD_FORMAT_SIGNED_INT16:
+      case CU_AD_FORMAT_HALF:
+        return 2;
+      default:
+        return 4;
+    }
+  }
+
+  void createManager(uint64_t bytes) {
+    auto account = detail::account(MemoryKind::Array, bytes);
+    manager = std::shared_ptr<CUarray>(
+        new CUarray(_obj), [bytes, account](CUarray *ptr) {
+          CUarray array = *ptr;
+          detail::release(bytes, [array, bytes, account] {
+            checkCudaCall(cuArrayDestroy(array));
+            detail::unaccount(account, bytes);
+          });
+          delete ptr;
+        });
+  }
+};
+
+class Module : public Wrapper<CUmodule> {
+ public:
+  explicit Module(const char *file_name) {
+#if defined TEGRA_QUIRKS  // cuModuleLoad broken on Jetson TX1
+    std::ifstream file(file_name);
+    std::string program((std::istreambuf_iterator<char>(file)),
+                        std::istreambuf_iterator<char>());
+    checkCudaCall(cuModuleLoadData(&_obj, program.c_str()));
+#else
+    checkCudaCall(cuModuleLoad(&_obj, file_name));
+#endif
+    manager = std::shared_ptr<CUmodule>(new CUmodule(_obj), [](CUmodule *ptr) {
+      checkCudaCall(cuModuleUnload(*ptr));
+      delete ptr;
+    });
+  }
+
+  explicit Module(const void *data) {
+    checkCudaCall(cuModuleLoadData(&_obj, data));
+    manager = std::shared_ptr<CUmodule>(new CUmodule(_obj), [](CUmodule *ptr) {
+      checkCudaCall(cuModuleUnload(*ptr));
+      delete ptr;
+    });
+  }
+
+  typedef std::map<CUjit_option, void *> optionmap_t;
+  explicit Module(const void *image, Module::optionmap_t &options) {
+    std::vector<CUjit_option> keys;
+    std::vector<void *> values;
+
+    for (const std::pair<CUjit_option, void *> &i : options) {
+      keys.push_back(i.first);
+      values.push_back(i.second);
+    }
+
+    checkCudaCall(cuModuleLoadDataEx(&_obj, image, options.size(), keys.data(),
+                                     values.data()));
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+      options[keys[i]] = values[i];
+    }
+  }
+
+  explicit Module(CUmodule &module) : Wrapper(module) {}
+
   CUdeviceptr getGlobal(const char *name) const {
     CUdeviceptr deviceptr{};
     checkCudaCall(cuModuleGetGlobal(&deviceptr, nullptr, _obj, name));
@@ -563,10 +1601,125 @@ class Event : public Wrapper<CUevent> {
 
   void record(Stream &);
 
-  void synchronize() { checkCudaCall(cuEventSynchronize(_obj)); }
+  void synchronize() {
+    detail::countSynchronize([&] { checkCudaCall(cuEventSynchronize(_obj)); });
+  }
+};
+
+// How an operation on a stream uses a buffer, see setHazardTracking()
+enum class Access { Read, Write };
+
+namespace detail {
+inline std::atomic<bool> &getHazardTrackingEnabled() {
+  static std::atomic<bool> enabled{false};
+  return enabled;
+}
+
+// A stream as HazardState keeps track of it. The driver may reuse the handle
+// of a destroyed stream, so the streams that a Stream created are also told
+// apart by the Stream's manager.
+struct StreamId {
+  CUstream handle;
+  std::weak_ptr<CUstream> owner;
+  bool owned;
+
+  bool operator==(const StreamId &other) const {
+    return handle == other.handle && !owner.owner_before(other.owner) &&
+           !other.owner.owner_before(owner);
+  }
+
+  bool destroyed() const { return owned && owner.expired(); }
+};
+
+// The last write to a buffer and the reads since, as events per stream. An
+// access first waits for the accesses on other streams that it conflicts with:
+// a read for the last write, a write also for the reads. Accesses on the same
+// stream are ordered by the stream already, and a stream waits for an access
+// only once, also when accesses are nested.
+class HazardState {
+ public:
+  void begin(const StreamId &stream, Access access) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_writer && !contains(_ordered, stream)) {
+      wait(stream, *_writer);
+      _ordered.push_back(stream);
+    }
+    if (access == Access::Write) {
+      for (Reader &reader : _readers) {
+        if (reader.pending && !contains(reader.ordered, stream)) {
+          wait(stream, reader.event);
+          reader.ordered.push_back(stream);
+        }
+      }
+    }
+  }
+
+  void end(const StreamId &stream, Access access) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (access == Access::Write) {
+      if (!_writer) {
+        _writer.reset(new Event(CU_EVENT_DISABLE_TIMING));
+      }
+      checkCudaCall(cuEventRecord(*_writer, stream.handle));
+      _ordered.assign(1, stream);
+      // The reads are ordered before this write, so the readers of destroyed
+      // streams are no longer needed
+      _readers.remove_if(
+          [](const Reader &reader) { return reader.stream.destroyed(); });
+      for (Reader &reader : _readers) {
+        reader.pending = false;
+        reader.ordered.clear();
+      }
+      return;
+    }
+    auto reader = std::find_if(
+        _readers.begin(), _readers.end(),
+        [&stream](const Reader &other) { return other.stream == stream; });
+    if (reader == _readers.end()) {
+      _readers.push_back(
+          Reader{stream, Event(CU_EVENT_DISABLE_TIMING), false, {}});
+      reader = std::prev(_readers.end());
+    }
+    checkCudaCall(cuEventRecord(reader->event, stream.handle));
+    reader->pending = true;
+    reader->ordered.assign(1, stream);
+  }
+
+ private:
+  struct Reader {
+    StreamId stream;
+    Event event;  // re-recorded by every read on the stream
+    bool pending;
+    std::vector<StreamId> ordered;  // the streams ordered after the event
+  };
+
+  static bool contains(const std::vector<StreamId> &streams,
+                       const StreamId &stream) {
+    return std::find(streams.begin(), streams.end(), stream) != streams.end();
+  }
+
+  static void wait(const StreamId &stream, Event &event) {
+    checkCudaCall(cuStreamWaitEvent(stream.handle, event, 0));
+    count(getCounters().hazardWaits);
+  }
+
+  std::mutex _mutex;
+  std::unique_ptr<Event> _writer;
+  std::vector<StreamId> _ordered;  // the streams ordered after the last write
+  std::list<Reader> _readers;
 };
+}  // namespace detail
+
+// Track the accesses to DeviceMemory that is allocated from now on, such that
+// the Stream operations that take it wait for the conflicting operations on
+// other streams, see DeviceMemory::enableHazardTracking()
+inline void setHazardTracking(bool enabled) {
+  detail::getHazardTrackingEnabled().store(enabled);
+}
 
 class DeviceMemory : public Wrapper<CUdeviceptr> {
+  friend class Stream;
+
  public:
   explicit DeviceMemory(size_t size, CUmemorytype type = CU_MEMORYTYPE_DEVICE,
                         unsigned int flags = 0)
@@ -581,11 +1734,25 @@ class DeviceMemory : public Wrapper<CUdeviceptr> {
     } else {
       throw Error(CUDA_ERROR_INVALID_VALUE);
     }
-    manager = std::shared_ptr<CUdeviceptr>(new CUdeviceptr(_obj),
-                                           [](CUdeviceptr *ptr) {
-                                             checkCudaCall(cuMemFree(*ptr));
-                                             delete ptr;
-                                           });
+    detail::count(getCounters().deviceAllocations);
+    detail::count(getCounters().deviceBytes, size);
+    auto account = detail::account(type == CU_MEMORYTYPE_UNIFIED
+                                       ? MemoryKind::Managed
+                                       : MemoryKind::Device,
+                                   size);
+    manager = std::shared_ptr<CUdeviceptr>(
+        new CUdeviceptr(_obj), [size, account](CUdeviceptr *ptr) {
+          CUdeviceptr devPtr = *ptr;
+          detail::release(size, [devPtr, size, account] {
+            checkCudaCall(cuMemFree(devPtr));
+            detail::uncount(getCounters().deviceBytes, size);
+            detail::unaccount(account, size);
+          });
+          delete ptr;
+        });
+    if (detail::getHazardTrackingEnabled()) {
+      enableHazardTracking();
+    }
   }
 
   explicit DeviceMemory(CUdeviceptr ptr) : Wrapper(ptr) {}
@@ -597,8 +1764,9 @@ class DeviceMemory : public Wrapper<CUdeviceptr> {
     checkCudaCall(cuMemHostGetDevicePointer(&_obj, hostMemory, 0));
   }
 
+  // A slice shares the hazard tracking of other, if any
   explicit DeviceMemory(const DeviceMemory &other, size_t offset, size_t size)
-      : _size(size) {
+      : _size(size), _hazards(other._hazards) {
     if (size + offset > other.size()) {
       throw Error(CUDA_ERROR_INVALID_VALUE);
     }
@@ -646,6 +1814,61 @@ class DeviceMemory : public Wrapper<CUdeviceptr> {
 
   void zero(size_t size) { memset(static_cast<unsigned char>(0), size); }
 
+  // The attributes of a range of managed memory, see getRangeAttributes()
+  struct RangeAttributes {
+    bool readMostly;
+    int preferredLocation;  // a device ordinal, CU_DEVICE_CPU or _INVALID
+    int lastPrefetchLocation;
+  };
+
+  // Advise the driver on the use of a range of managed memory, e.g.
+  // CU_MEM_ADVISE_SET_READ_MOSTLY or CU_MEM_ADVISE_SET_PREFERRED_LOCATION
+  void advise(CUmem_advise advice, size_t size) {
+    checkCudaCall(cuMemAdvise(_obj, size, advice, CU_DEVICE_CPU));
+  }
+
+  void advise(CUmem_advise advice, size_t size, const Device &device) {
+    checkCudaCall(cuMemAdvise(_obj, size, advice, device));
+  }
+
+  int getRangeAttribute(CUmem_range_attribute attribute, size_t size) const {
+    int value{};
+    checkCudaCall(
+        cuMemRangeGetAttribute(&value, sizeof(value), attribute, _obj, size));
+    return value;
+  }
+
+  RangeAttributes getRangeAttributes(size_t size) const {
+    int readMostly{};
+    RangeAttributes attributes{};
+    std::array<void *, 3> data{&readMostly, &attributes.preferredLocation,
+                               &attributes.lastPrefetchLocation};
+    std::array<size_t, 3> dataSizes{sizeof(int), sizeof(int), sizeof(int)};
+    std::array<CUmem_range_attribute, 3> rangeAttributes{
+        CU_MEM_RANGE_ATTRIBUTE_READ_MOSTLY,
+        CU_MEM_RANGE_ATTRIBUTE_PREFERRED_LOCATION,
+        CU_MEM_RANGE_ATTRIBUTE_LAST_PREFETCH_LOCATION};
+    checkCudaCall(cuMemRangeGetAttributes(data.data(), dataSizes.data(),
+                                          rangeAttributes.data(), data.size(),
+                                          _obj, size));
+    attributes.readMostly = readMostly != 0;
+    return attributes;
+  }
+
+  // The devices that are advised to access the range (CU_DEVICE_CPU included)
+  std::vector<int> getAccessedBy(size_t size) const {
+    int count{};
+    checkCudaCall(cuDeviceGetCount(&count));
+    std::vector<int> devices(count + 1);
+    checkCudaCall(cuMemRangeGetAttribute(
+        devices.data(), devices.size() * sizeof(int),
+        CU_MEM_RANGE_ATTRIBUTE_ACCESSED_BY, _obj, size));
+    devices.erase(std::remove(devices.begin(), devices.end(),
+                              static_cast<int>(CU_DEVICE_INVALID)),
+                  devices.end());
+    return devices;
+  }
+
   const void *parameter()
       const  // used to construct parameter list for launchKernel();
   {
@@ -666,69 +1889,553 @@ class DeviceMemory : public Wrapper<CUdeviceptr> {
 
   size_t size() const { return _size; }
 
+  // From now on, the Stream operations that take this memory, or a slice of it
+  // made afterwards, wait for the last write to it on other streams, and
+  // writes also for the reads since. Copies of the object share the tracking.
+  // Kernels declare their accesses, see Stream::launchKernel().
+  void enableHazardTracking() {
+    if (!_hazards) {
+      _hazards = std::make_shared<detail::HazardState>();
+    }
+  }
+
+  bool isHazardTracked() const { return _hazards != nullptr; }
+
  private:
   size_t _size;
+  // The accounting of memory from Stream::memAllocAsync(), which is released
+  // by Stream::memFreeAsync()
+  detail::MemoryAccounting::Slot *_account{nullptr};
+  std::shared_ptr<detail::HazardState> _hazards;
 };
 
-class Stream : public Wrapper<CUstream> {
-  friend class Event;
+// A buffer that an operation on a stream reads or writes
+struct BufferAccess {
+  const DeviceMemory &buffer;
+  Access access;
+};
 
+/*
+ * HostCopyEngine
+ *
+ * Copies host memory with a pool of threads, e.g. from pageable memory into
+ * pinned staging buffers, which a single thread cannot do at PCIe speed.
+ * Large copies use non-temporal stores (AVX-512, AVX2 or SSE2, whatever the
+ * CPU supports), such that the destination does not evict the source from the
+ * caches. The threads are bound to a NUMA node if one is given, e.g.
+ * HostCopyEngine engine(threads, device.getNumaNode());
+ */
+class HostCopyEngine {
  public:
-  explicit Stream(unsigned int flags = CU_STREAM_DEFAULT) {
-    checkCudaCall(cuStreamCreate(&_obj, flags));
-    manager = std::shared_ptr<CUstream>(new CUstream(_obj), [](CUstream *ptr) {
-      checkCudaCall(cuStreamDestroy(*ptr));
-      delete ptr;
-    });
+  struct Benchmark {
+    double engineBandwidth;  // bytes/s
+    double memcpyBandwidth;  // bytes/s, single-threaded std::memcpy
+  };
+
+  explicit HostCopyEngine(unsigned int threads = defaultThreadCount(),
+                          int numaNode = -1)
+      : _threads(std::max(threads, 1u)) {
+    const std::vector<int> cpus = getNumaCpus(numaNode);
+    for (unsigned int i = 1; i < _threads; i++) {
+      _workers.emplace_back([this, i] { run(i); });
+      bind(_workers.back(), cpus);
+    }
   }
 
-  explicit Stream(CUstream stream) : Wrapper<CUstream>(stream) {}
+  HostCopyEngine(const HostCopyEngine &) = delete;
+  HostCopyEngine &operator=(const HostCopyEngine &) = delete;
 
-  DeviceMemory memAllocAsync(size_t size) {
-    CUdeviceptr ptr;
-    checkCudaCall(cuMemAllocAsync(&ptr, size, _obj));
-    return DeviceMemory(ptr, size);
+  ~HostCopyEngine() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _start.notify_all();
+    for (std::thread &worker : _workers) {
+      worker.join();
+    }
   }
 
-  void memFreeAsync(DeviceMemory &devMem) {
-    checkCudaCall(cuMemFreeAsync(devMem, _obj));
+  static unsigned int defaultThreadCount() {
+    return std::min(std::max(std::thread::hardware_concurrency() / 2, 1u), 8u);
   }
 
-  void memcpyHtoHAsync(void *dstPtr, const void *srcPtr, size_t size) {
-#if defined(__HIP__)
-    checkCudaCall(hipMemcpyAsync(
-        reinterpret_cast<CUdeviceptr>(dstPtr),
-        reinterpret_cast<CUdeviceptr>(const_cast<void *>(srcPtr)), size,
-        hipMemcpyDefault, _obj));
-#else
-    checkCudaCall(cuMemcpyAsync(reinterpret_cast<CUdeviceptr>(dstPtr),
-                                reinterpret_cast<CUdeviceptr>(srcPtr), size,
-                                _obj));
-#endif
+  unsigned int getThreadCount() const { return _threads; }
+
+  // Copies are split in parts of at least minPartSize bytes, of which the
+  // calling thread copies the first
+  void copy(void *dst, const void *src, size_t size) {
+    const size_t minPartSize = 1 << 20;
+    const size_t parts =
+        std::min<size_t>(_threads, std::max<size_t>(size / minPartSize, 1));
+    if (parts == 1) {
+      copyPart(dst, src, size);
+      return;
+    }
+
+    std::lock_guard<std::mutex> submit(_submit);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _job = Job{static_cast<char *>(dst), static_cast<const char *>(src),
+                 size, parts};
+      _pending = parts - 1;
+      _generation++;
+    }
+    _start.notify_all();
+    copyJobPart(0);
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [&] { return _pending == 0; });
   }
 
-  void memcpyHtoDAsync(DeviceMemory &devPtr, const void *hostPtr, size_t size) {
-#if defined(__HIP__)
-    checkCudaCall(
-        hipMemcpyHtoDAsync(devPtr, const_cast<void *>(hostPtr), size, _obj));
-#else
-    checkCudaCall(cuMemcpyHtoDAsync(devPtr, hostPtr, size, _obj));
-#endif
+  // The engine must outlive the function
+  std::function<void(void *, const void *, size_t)> getCopyFunction() {
+    return [this](void *dst, const void *src, size_t size) {
+      copy(dst, src, size);
+    };
   }
 
-  void memcpyHtoD2DAsync(DeviceMemory &devPtr, size_t dpitch,
-                         const void *hostPtr, size_t spitch, size_t width,
-                         size_t height) {
-#if defined(__HIP__)
-    checkCudaCall(hipMemcpy2DAsync(devPtr, dpitch, hostPtr, spitch, width,
-                                   height, hipMemcpyHostToDevice, _obj));
-#else
-    // Initialize the CUDA_MEMCPY2D structure
-    CUDA_MEMCPY2D copyParams = {0};
+  // Compare the bandwidth of copies from pageable into pinned memory
+  Benchmark benchmark(size_t size = 256 << 20, unsigned int iterations = 5) {
+    std::vector<char> src(size, 1);
+    HostMemory dst(size);
+    const auto measure = [&](const std::function<void()> &function) {
+      function();  // warm up, e.g. fault in the pages
+      const auto start = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < iterations; i++) {
+        function();
+      }
+      const std::chrono::duration<double> seconds =
+          std::chrono::steady_clock::now() - start;
+      return static_cast<double>(size) * iterations / seconds.count();
+    };
+
+    Benchmark result{};
+    result.engineBandwidth =
+        measure([&] { copy(static_cast<void *>(dst), src.data(), size); });
+    result.memcpyBandwidth = measure(
+        [&] { std::memcpy(static_cast<void *>(dst), src.data(), size); });
+    return result;
+  }
 
-    // Set width and height for the 2D copy
-    copyParams.WidthInBytes = width;
-    copyParams.Height = height;
+ private:
+  struct Job {
+    char *dst;
+    const char *src;
+    size_t size;
+    size_t parts;
+  };
+
+  // Split at multiples of 64 bytes, such that all but the first part start
+  // at the same alignment as the copy
+  void copyJobPart(size_t part) {
+    const size_t partSize = (_job.size / _job.parts) & ~size_t(63);
+    const size_t begin = part * partSize;
+    const size_t end = part == _job.parts - 1 ? _job.size : begin + partSize;
+    copyPart(_job.dst + begin, _job.src + begin, end - begin);
+  }
+
+  static void copyPart(void *dst, const void *src, size_t size) {
+#if defined(CUDAWRAPPERS_HAVE_NT_COPY)
+    const size_t minStreamSize = 256 << 10;
+    if (size >= minStreamSize) {
+      if (__builtin_cpu_supports("avx512f")) {
+        return streamCopyAVX512(static_cast<char *>(dst),
+                                static_cast<const char *>(src), size);
+      } else if (__builtin_cpu_supports("avx2")) {
+        return streamCopyAVX2(static_cast<char *>(dst),
+                              static_cast<const char *>(src), size);
+      }
+      return streamCopySSE2(static_cast<char *>(dst),
+                            static_cast<const char *>(src), size);
+    }
+#endif
+    std::memcpy(dst, src, size);
+  }
+
+#if defined(CUDAWRAPPERS_HAVE_NT_COPY)
+  // Copy the unaligned head and tail with memcpy, and the remainder with
+  // aligned non-temporal stores
+  static size_t alignHead(char *&dst, const char *&src, size_t &size,
+                          size_t alignment) {
+    const size_t head = std::min(
+        size, (alignment - reinterpret_cast<uintptr_t>(dst) % alignment) %
+                  alignment);
+    std::memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+    return size & ~(alignment - 1);
+  }
+
+  __attribute__((target("avx512f"))) static void streamCopyAVX512(
+      char *dst, const char *src, size_t size) {
+    const size_t body = alignHead(dst, src, size, 64);
+    for (size_t i = 0; i < body; i += 64) {
+      _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + i),
+                          _mm512_loadu_si512(src + i));
+    }
+    _mm_sfence();
+    std::memcpy(dst + body, src + body, size - body);
+  }
+
+  __attribute__((target("avx2"))) static void streamCopyAVX2(char *dst,
+                                                             const char *src,
+                                                             size_t size) {
+    const size_t body = alignHead(dst, src, size, 32);
+    for (size_t i = 0; i < body; i += 32) {
+      _mm256_stream_si256(
+          reinterpret_cast<__m256i *>(dst + i),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i)));
+    }
+    _mm_sfence();
+    std::memcpy(dst + body, src + body, size - body);
+  }
+
+  static void streamCopySSE2(char *dst, const char *src, size_t size) {
+    const size_t body = alignHead(dst, src, size, 16);
+    for (size_t i = 0; i < body; i += 16) {
+      _mm_stream_si128(
+          reinterpret_cast<__m128i *>(dst + i),
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+    }
+    _mm_sfence();
+    std::memcpy(dst + body, src + body, size - body);
+  }
+#endif
+
+  void run(unsigned int index) {
+    size_t generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _start.wait(lock,
+                    [&] { return _stopping || _generation != generation; });
+        if (_stopping) {
+          return;
+        }
+        generation = _generation;
+        if (index >= _job.parts) {
+          continue;
+        }
+      }
+      copyJobPart(index);
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (--_pending == 0) {
+        _done.notify_one();
+      }
+    }
+  }
+
+  // The CPUs of a NUMA node, or none to not bind the threads
+  static std::vector<int> getNumaCpus(int numaNode) {
+    std::vector<int> cpus;
+    if (numaNode < 0) {
+      return cpus;
+    }
+    std::ifstream file("/sys/devices/system/node/node" +
+                       std::to_string(numaNode) + "/cpulist");
+    std::string range;
+    while (std::getline(file, range, ',')) {
+      int first = 0;
+      int last = -1;
+      if (std::sscanf(range.c_str(), "%d-%d", &first, &last) == 1) {
+        last = first;
+      }
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+
+  static void bind(std::thread &thread, const std::vector<int> &cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) {
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+  }
+
+  unsigned int _threads;
+  std::vector<std::thread> _workers;
+  std::mutex _submit;  // one copy at a time
+  std::mutex _mutex;
+  std::condition_variable _start;
+  std::condition_variable _done;
+  Job _job{};
+  size_t _pending{0};
+  size_t _generation{0};
+  bool _stopping{false};
+};
+
+inline HostCopyEngine &getHostCopyEngine() {
+  static HostCopyEngine engine;
+  return engine;
+}
+
+/*
+ * StagingRing
+ *
+ * A ring of pinned bounce buffers through which asynchronous copies from and
+ * to pageable host memory are pipelined in chunks. Without it, such copies
+ * are synchronous. The host side of every chunk is copied by a host function
+ * on an internal stream, overlapping with the transfer of the previous chunk,
+ * such that the copy call returns immediately. As with any asynchronous copy,
+ * the host memory must remain valid until the copy completed on the stream.
+ */
+class StagingRing {
+ public:
+  using CopyFunction =
+      std::function<void(void *dst, const void *src, size_t size)>;
+
+  static const size_t defaultChunkSize = 4 << 20;
+
+  explicit StagingRing(size_t chunkSize = defaultChunkSize,
+                       unsigned int chunks = 4,
+                       CopyFunction copy = defaultCopy)
+      : _chunkSize(chunkSize), _copy(std::move(copy)), _ready(eventFlags) {
+    if (chunkSize == 0 || chunks == 0) {
+      throw Error(CUDA_ERROR_INVALID_VALUE);
+    }
+    checkCudaCall(cuStreamCreate(&_stream, CU_STREAM_NON_BLOCKING));
+    for (unsigned int i = 0; i < chunks; i++) {
+      _slots.emplace_back(chunkSize);
+    }
+  }
+
+  StagingRing(const StagingRing &) = delete;
+  StagingRing &operator=(const StagingRing &) = delete;
+
+  ~StagingRing() {
+    // Wait for the host functions and for the transfers from and to the
+    // buffers, which are enqueued on the internal and the user's streams
+    cuStreamSynchronize(_stream);
+    for (Slot &slot : _slots) {
+      cuEventSynchronize(slot.free);
+    }
+    cuStreamDestroy(_stream);
+  }
+
+  size_t getChunkSize() const { return _chunkSize; }
+
+  // Replace the function that copies between host memory and the buffers,
+  // e.g. by a multi-threaded copy, only while no copies are in flight
+  void setCopyFunction(CopyFunction copy) { _copy = std::move(copy); }
+
+  void memcpyHtoDAsync(CUstream stream, CUdeviceptr dst, const void *src,
+                       size_t size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // The source may be written by work that precedes the copy
+    checkCudaCall(cuEventRecord(_ready, stream));
+    checkCudaCall(cuStreamWaitEvent(_stream, _ready, 0));
+    for (size_t offset = 0; offset < size; offset += _chunkSize) {
+      const size_t bytes = std::min(_chunkSize, size - offset);
+      Slot &slot = nextSlot();
+      checkCudaCall(cuStreamWaitEvent(_stream, slot.free, 0));
+      launchCopy(slot.buffer, static_cast<const char *>(src) + offset, bytes);
+      checkCudaCall(cuEventRecord(slot.filled, _stream));
+      checkCudaCall(cuStreamWaitEvent(stream, slot.filled, 0));
+      const CUdeviceptr chunk =
+          reinterpret_cast<CUdeviceptr>(reinterpret_cast<char *>(dst) + offset);
+#if defined(__HIP__)
+      checkCudaCall(hipMemcpyHtoDAsync(chunk, slot.buffer, bytes, stream));
+#else
+      checkCudaCall(cuMemcpyHtoDAsync(chunk, slot.buffer, bytes, stream));
+#endif
+      checkCudaCall(cuEventRecord(slot.free, stream));
+    }
+  }
+
+  void memcpyDtoHAsync(CUstream stream, void *dst, CUdeviceptr src,
+                       size_t size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t offset = 0; offset < size; offset += _chunkSize) {
+      const size_t bytes = std::min(_chunkSize, size - offset);
+      Slot &slot = nextSlot();
+      checkCudaCall(cuStreamWaitEvent(stream, slot.free, 0));
+      const CUdeviceptr chunk =
+          reinterpret_cast<CUdeviceptr>(reinterpret_cast<char *>(src) + offset);
+      checkCudaCall(cuMemcpyDtoHAsync(slot.buffer, chunk, bytes, stream));
+      checkCudaCall(cuEventRecord(slot.filled, stream));
+      checkCudaCall(cuStreamWaitEvent(_stream, slot.filled, 0));
+      launchCopy(static_cast<char *>(dst) + offset, slot.buffer, bytes);
+      checkCudaCall(cuEventRecord(slot.free, _stream));
+    }
+    // Work that follows the copy on the stream may read the destination
+    checkCudaCall(cuEventRecord(_ready, _stream));
+    checkCudaCall(cuStreamWaitEvent(stream, _ready, 0));
+  }
+
+ private:
+  static const unsigned int eventFlags = CU_EVENT_DISABLE_TIMING;
+
+  struct Slot {
+    explicit Slot(size_t size)
+        : buffer(size, CU_MEMHOSTALLOC_PORTABLE),
+          free(eventFlags),
+          filled(eventFlags) {}
+
+    HostMemory buffer;
+    Event free;    // the buffer may be reused
+    Event filled;  // the buffer holds the chunk
+  };
+
+  struct Task {
+    StagingRing *ring;
+    void *dst;
+    const void *src;
+    size_t size;
+  };
+
+  static void defaultCopy(void *dst, const void *src, size_t size) {
+    getHostCopyEngine().copy(dst, src, size);
+  }
+
+  static void execute(void *userData) {
+    std::unique_ptr<Task> task(static_cast<Task *>(userData));
+    task->ring->_copy(task->dst, task->src, task->size);
+  }
+
+  Slot &nextSlot() { return _slots[_next++ % _slots.size()]; }
+
+  void launchCopy(void *dst, const void *src, size_t size) {
+    std::unique_ptr<Task> task(new Task{this, dst, src, size});
+    checkCudaCall(cuLaunchHostFunc(_stream, execute, task.get()));
+    task.release();
+  }
+
+  size_t _chunkSize;
+  CopyFunction _copy;
+  Event _ready;
+  CUstream _stream;
+  std::vector<Slot> _slots;
+  size_t _next{0};
+  std::mutex _mutex;
+};
+
+class Stream : public Wrapper<CUstream> {
+  friend class Event;
+
+ public:
+  explicit Stream(unsigned int flags = CU_STREAM_DEFAULT) {
+    checkCudaCall(cuStreamCreate(&_obj, flags));
+    manager = std::shared_ptr<CUstream>(new CUstream(_obj), [](CUstream *ptr) {
+      checkCudaCall(cuStreamDestroy(*ptr));
+      delete ptr;
+    });
+  }
+
+  explicit Stream(CUstream stream) : Wrapper<CUstream>(stream) {}
+
+  DeviceMemory memAllocAsync(size_t size) {
+    CUdeviceptr ptr;
+    checkCudaCall(cuMemAllocAsync(&ptr, size, _obj));
+    detail::count(getCounters().deviceAllocations);
+    detail::count(getCounters().deviceBytes, size);
+    DeviceMemory memory(ptr, size);
+    memory._account = detail::account(MemoryKind::Async, size);
+    if (detail::getHazardTrackingEnabled()) {
+      memory.enableHazardTracking();
+    }
+    return memory;
+  }
+
+  // Like memAllocAsync(), but the memory is freed with cuMemFreeAsync on this
+  // stream, which does not synchronize, when the last reference to it is
+  // destroyed. Do not pass it to memFreeAsync(). The free is only ordered
+  // after the work on this stream: work on other streams that uses the memory
+  // must be made to precede it, e.g. with an event that this stream waits
+  // for, or with DeviceMemory::enableHazardTracking(). A free that fails
+  // cannot be reported and leaks the memory.
+  DeviceMemory memAllocAsyncOwned(size_t size) {
+    DeviceMemory memory = memAllocAsync(size);
+    Stream stream(*this);
+    auto account = memory._account;
+    auto hazards = memory._hazards;
+    memory._account = nullptr;
+    memory.manager = std::shared_ptr<CUdeviceptr>(
+        new CUdeviceptr(memory._obj),
+        [stream, size, account, hazards](CUdeviceptr *ptr) {
+          bool ordered = true;
+          try {
+            if (hazards) {
+              hazards->begin(stream.id(), Access::Write);
+            }
+          } catch (const Error &) {
+            ordered = false;  // the memory may still be in use
+          }
+          if (ordered && cuMemFreeAsync(*ptr, stream) == CUDA_SUCCESS) {
+            detail::uncount(getCounters().deviceBytes, size);
+            detail::unaccount(account, size);
+          }
+          delete ptr;
+        });
+    return memory;
+  }
+
+  void memFreeAsync(DeviceMemory &devMem) {
+    beginAccess(devMem, Access::Write);
+    checkCudaCall(cuMemFreeAsync(devMem, _obj));
+    detail::uncount(getCounters().deviceBytes, devMem.size());
+    detail::unaccount(devMem._account, devMem.size());
+    devMem._account = nullptr;
+  }
+
+  void memcpyHtoHAsync(void *dstPtr, const void *srcPtr, size_t size) {
+#if defined(__HIP__)
+    checkCudaCall(hipMemcpyAsync(
+        reinterpret_cast<CUdeviceptr>(dstPtr),
+        reinterpret_cast<CUdeviceptr>(const_cast<void *>(srcPtr)), size,
+        hipMemcpyDefault, _obj));
+#else
+    checkCudaCall(cuMemcpyAsync(reinterpret_cast<CUdeviceptr>(dstPtr),
+                                reinterpret_cast<CUdeviceptr>(srcPtr), size,
+                                _obj));
+#endif
+    detail::count(getCounters().bytesCopiedHtoH, size);
+  }
+
+  // Copies from and to pageable host memory are pipelined through a ring of
+  // pinned buffers, such that they do not block the calling thread
+  void enableStaging(size_t chunkSize = StagingRing::defaultChunkSize,
+                     unsigned int chunks = 4) {
+    _staging = std::make_shared<StagingRing>(chunkSize, chunks);
+  }
+
+  void enableStaging(std::shared_ptr<StagingRing> staging) {
+    _staging = std::move(staging);
+  }
+
+  void disableStaging() { _staging.reset(); }
+
+  std::shared_ptr<StagingRing> getStaging() const { return _staging; }
+
+  void memcpyHtoDAsync(DeviceMemory &devPtr, const void *hostPtr, size_t size) {
+    beginAccess(devPtr, Access::Write);
+    memcpyHtoDAsync(static_cast<CUdeviceptr>(devPtr), hostPtr, size);
+    endAccess(devPtr, Access::Write);
+  }
+
+  void memcpyHtoD2DAsync(DeviceMemory &devPtr, size_t dpitch,
+                         const void *hostPtr, size_t spitch, size_t width,
+                         size_t height) {
+    beginAccess(devPtr, Access::Write);
+#if defined(__HIP__)
+    checkCudaCall(hipMemcpy2DAsync(devPtr, dpitch, hostPtr, spitch, width,
+                                   height, hipMemcpyHostToDevice, _obj));
+#else
+    // Initialize the CUDA_MEMCPY2D structure
+    CUDA_MEMCPY2D copyParams = {0};
+
+    // Set width and height for the 2D copy
+    copyParams.WidthInBytes = width;
+    copyParams.Height = height;
 
     // Set the destination (dst)
     copyParams.dstXInBytes = 0;
@@ -748,11 +2455,14 @@ class Stream : public Wrapper<CUstream> {
     // Call the driver API function cuMemcpy2DAsync
     checkCudaCall(cuMemcpy2DAsync(&copyParams, _obj));
 #endif
+    detail::count(getCounters().bytesCopiedHtoD, width * height);
+    endAccess(devPtr, Access::Write);
   }
 
   void memcpyDtoH2DAsync(void *hostPtr, size_t dpitch,
                          const DeviceMemory &devPtr, size_t spitch,
                          size_t width, size_t height) {
+    beginAccess(devPtr, Access::Read);
 #if defined(__HIP__)
     checkCudaCall(hipMemcpy2DAsync(hostPtr, dpitch, devPtr, spitch, width,
                                    height, hipMemcpyDeviceToHost, _obj));
@@ -782,32 +2492,51 @@ class Stream : public Wrapper<CUstream> {
     // Call the driver API function cuMemcpy2DAsync
     checkCudaCall(cuMemcpy2DAsync(&copyParams, _obj));
 #endif
+    detail::count(getCounters().bytesCopiedDtoH, width * height);
+    endAccess(devPtr, Access::Read);
   }
 
   void memcpyHtoDAsync(CUdeviceptr devPtr, const void *hostPtr, size_t size) {
+    if (_staging && detail::getHostRangeCache().isPageable(hostPtr, size)) {
+      _staging->memcpyHtoDAsync(_obj, devPtr, hostPtr, size);
+    } else {
 #if defined(__HIP__)
-    checkCudaCall(
-        hipMemcpyHtoDAsync(devPtr, const_cast<void *>(hostPtr), size, _obj));
+      checkCudaCall(
+          hipMemcpyHtoDAsync(devPtr, const_cast<void *>(hostPtr), size, _obj));
 #else
-    checkCudaCall(cuMemcpyHtoDAsync(devPtr, hostPtr, size, _obj));
+      checkCudaCall(cuMemcpyHtoDAsync(devPtr, hostPtr, size, _obj));
 #endif
+    }
+    detail::count(getCounters().bytesCopiedHtoD, size);
   }
 
   void memcpyDtoHAsync(void *hostPtr, const DeviceMemory &devPtr, size_t size) {
-    checkCudaCall(cuMemcpyDtoHAsync(hostPtr, devPtr, size, _obj));
+    beginAccess(devPtr, Access::Read);
+    memcpyDtoHAsync(hostPtr, static_cast<CUdeviceptr>(devPtr), size);
+    endAccess(devPtr, Access::Read);
   }
 
   void memcpyDtoHAsync(void *hostPtr, CUdeviceptr devPtr, size_t size) {
-    checkCudaCall(cuMemcpyDtoHAsync(hostPtr, devPtr, size, _obj));
+    if (_staging && detail::getHostRangeCache().isPageable(hostPtr, size)) {
+      _staging->memcpyDtoHAsync(_obj, hostPtr, devPtr, size);
+    } else {
+      checkCudaCall(cuMemcpyDtoHAsync(hostPtr, devPtr, size, _obj));
+    }
+    detail::count(getCounters().bytesCopiedDtoH, size);
   }
 
   void memcpyDtoDAsync(DeviceMemory &dstPtr, DeviceMemory &srcPtr,
                        size_t size) {
+    beginAccess(dstPtr, Access::Write);
+    beginAccess(srcPtr, Access::Read);
 #if defined(__HIP__)
     checkCudaCall(hipMemcpyAsync(dstPtr, srcPtr, size, hipMemcpyDefault, _obj));
 #else
     checkCudaCall(cuMemcpyAsync(dstPtr, srcPtr, size, _obj));
 #endif
+    detail::count(getCounters().bytesCopiedDtoD, size);
+    endAccess(srcPtr, Access::Read);
+    endAccess(dstPtr, Access::Write);
   }
 
   void memPrefetchAsync(DeviceMemory &devPtr, size_t size) {
@@ -818,45 +2547,66 @@ class Stream : public Wrapper<CUstream> {
     checkCudaCall(cuMemPrefetchAsync(devPtr, size, dstDevice, _obj));
   }
 
+  // Attach managed memory to this stream (CU_MEM_ATTACH_SINGLE), to the host
+  // (CU_MEM_ATTACH_HOST) or to all streams (CU_MEM_ATTACH_GLOBAL). The host may
+  // access memory that is attached to a stream once the stream is idle.
+  void attachMemAsync(DeviceMemory &devPtr,
+                      unsigned int flags = CU_MEM_ATTACH_SINGLE,
+                      size_t length = 0) {
+    checkCudaCall(cuStreamAttachMemAsync(_obj, devPtr, length, flags));
+  }
+
   void memsetAsync(DeviceMemory &devPtr, unsigned char value, size_t size) {
+    beginAccess(devPtr, Access::Write);
     checkCudaCall(cuMemsetD8Async(devPtr, value, size, _obj));
+    endAccess(devPtr, Access::Write);
   }
 
   void memsetAsync(DeviceMemory &devPtr, unsigned short value, size_t size) {
+    beginAccess(devPtr, Access::Write);
     checkCudaCall(cuMemsetD16Async(devPtr, value, size, _obj));
+    endAccess(devPtr, Access::Write);
   }
 
   void memsetAsync(DeviceMemory &devPtr, unsigned int value, size_t size) {
+    beginAccess(devPtr, Access::Write);
     checkCudaCall(cuMemsetD32Async(devPtr, value, size, _obj));
+    endAccess(devPtr, Access::Write);
   }
 
   void memset2DAsync(DeviceMemory &devPtr, unsigned char value, size_t pitch,
                      size_t width, size_t height) {
+    beginAccess(devPtr, Access::Write);
 #if defined(__HIP__)
     checkCudaCall(hipMemset2DAsync(devPtr, pitch, value, width, height, _obj));
 #else
     checkCudaCall(cuMemsetD2D8Async(devPtr, pitch, value, width, height, _obj));
 #endif
+    endAccess(devPtr, Access::Write);
   }
 
   void memset2DAsync(DeviceMemory &devPtr, unsigned short value, size_t pitch,
                      size_t width, size_t height) {
+    beginAccess(devPtr, Access::Write);
 #if defined(__HIP__)
     checkCudaCall(hipMemset2DAsync(devPtr, pitch, value, width, height, _obj));
 #else
     checkCudaCall(
         cuMemsetD2D16Async(devPtr, pitch, value, width, height, _obj));
 #endif
+    endAccess(devPtr, Access::Write);
   }
 
   void memset2DAsync(DeviceMemory &devPtr, unsigned int value, size_t pitch,
                      size_t width, size_t height) {
+    beginAccess(devPtr, Access::Write);
 #if defined(__HIP__)
     checkCudaCall(hipMemset2DAsync(devPtr, pitch, value, width, height, _obj));
 #else
     checkCudaCall(
         cuMemsetD2D32Async(devPtr, pitch, value, width, height, _obj));
 #endif
+    endAccess(devPtr, Access::Write);
   }
 
   void zero(DeviceMemory &devPtr, size_t size) {
@@ -874,6 +2624,33 @@ class Stream : public Wrapper<CUstream> {
     checkCudaCall(cuLaunchKernel(function, gridX, gridY, gridZ, blockX, blockY,
                                  blockZ, sharedMemBytes, _obj,
                                  const_cast<void **>(&parameters[0]), nullptr));
+    detail::count(getCounters().kernelLaunches);
+  }
+
+  // Launch a kernel that reads or writes the buffers, e.g.
+  // {{input, Access::Read}, {output, Access::Write}}, after the accesses to
+  // them on other streams that conflict with it, see setHazardTracking()
+  void launchKernel(Function &function, unsigned gridX, unsigned gridY,
+                    unsigned gridZ, unsigned blockX, unsigned blockY,
+                    unsigned blockZ, unsigned sharedMemBytes,
+                    const std::vector<const void *> &parameters,
+                    std::initializer_list<BufferAccess> buffers) {
+    access(buffers, [&] {
+      launchKernel(function, gridX, gridY, gridZ, blockX, blockY, blockZ,
+                   sharedMemBytes, parameters);
+    });
+  }
+
+  // Enqueue other work on the buffers, e.g. a library call, likewise
+  void access(std::initializer_list<BufferAccess> buffers,
+              const std::function<void()> &enqueue) {
+    for (const BufferAccess &buffer : buffers) {
+      beginAccess(buffer.buffer, buffer.access);
+    }
+    enqueue();
+    for (const BufferAccess &buffer : buffers) {
+      endAccess(buffer.buffer, buffer.access);
+    }
   }
 
 #if CUDART_VERSION >= 9000
@@ -885,6 +2662,7 @@ class Stream : public Wrapper<CUstream> {
     checkCudaCall(cuLaunchCooperativeKernel(
         function, gridX, gridY, gridZ, blockX, blockY, blockZ, sharedMemBytes,
         _obj, const_cast<void **>(&parameters[0])));
+    detail::count(getCounters().kernelLaunches);
   }
 #endif
 
@@ -892,7 +2670,9 @@ class Stream : public Wrapper<CUstream> {
     checkCudaCall(cuStreamQuery(_obj));  // unsuccessful result throws cu::Error
   }
 
-  void synchronize() { checkCudaCall(cuStreamSynchronize(_obj)); }
+  void synchronize() {
+    detail::countSynchronize([&] { checkCudaCall(cuStreamSynchronize(_obj)); });
+  }
 
   void wait(Event &event) { checkCudaCall(cuStreamWaitEvent(_obj, event, 0)); }
 
@@ -917,11 +2697,1544 @@ class Stream : public Wrapper<CUstream> {
   void writeValue32(CUdeviceptr addr, cuuint32_t value, unsigned flags) {
     checkCudaCall(cuStreamWriteValue32(_obj, addr, value, flags));
   }
+
+ private:
+  detail::StreamId id() const {
+    return detail::StreamId{_obj, manager, manager != nullptr};
+  }
+
+  void beginAccess(const DeviceMemory &buffer, Access access) {
+    if (buffer._hazards) {
+      buffer._hazards->begin(id(), access);
+    }
+  }
+
+  void endAccess(const DeviceMemory &buffer, Access access) {
+    if (buffer._hazards) {
+      buffer._hazards->end(id(), access);
+    }
+  }
+
+  std::shared_ptr<StagingRing> _staging;
 };
 
 inline void Event::record(Stream &stream) {
   checkCudaCall(cuEventRecord(_obj, stream._obj));
 }
+
+#if defined(__linux__)
+namespace detail {
+// A file with a ring of page-locked buffers, and threads that read or write
+// the buffers from or to the file, for FileLoader and FileWriter. With direct
+// I/O (O_DIRECT, bypassing the page cache), file offsets and transfer sizes
+// must be multiples of alignment; if the file system does not support direct
+// I/O, the file is opened without it.
+class FileRing {
+ public:
+  static const size_t alignment = 4096;
+
+  struct Slot {
+    explicit Slot(size_t size)
+        : buffer(size, CU_MEMHOSTALLOC_PORTABLE),
+          event(CU_EVENT_DISABLE_TIMING) {}
+
+    HostMemory buffer;
+    Event event;  // recorded after the copy from or to the buffer
+    off_t offset{0};
+    size_t size{0};
+    size_t transferred{0};
+    int error{0};
+    bool busy{false};
+    bool write{false};
+  };
+
+  FileRing(const std::string &path, int flags, size_t chunkSize,
+           unsigned int chunks, unsigned int threads, bool direct)
+      : _path(path), _chunkSize(chunkSize) {
+    if (chunkSize == 0 || chunkSize % alignment != 0 || chunks == 0) {
+      throw std::invalid_argument("chunk size must be a multiple of " +
+                                  std::to_string(alignment));
+    }
+    _fd = -1;
+#if defined(O_DIRECT)
+    if (direct) {
+      _fd = open(path.c_str(), flags | O_DIRECT, 0644);
+    }
+#endif
+    _direct = _fd >= 0;
+    if (_fd < 0) {
+      _fd = open(path.c_str(), flags, 0644);
+    }
+    if (_fd < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    for (unsigned int i = 0; i < chunks; i++) {
+      _slots.emplace_back(new Slot(chunkSize));
+    }
+    for (unsigned int i = 0; i < std::max(threads, 1u); i++) {
+      _threads.emplace_back([this] { run(); });
+    }
+  }
+
+  FileRing(const FileRing &) = delete;
+  FileRing &operator=(const FileRing &) = delete;
+
+  ~FileRing() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _submitted.notify_all();
+    for (std::thread &thread : _threads) {
+      thread.join();
+    }
+    close(_fd);
+  }
+
+  int getFileDescriptor() const { return _fd; }
+  bool isDirect() const { return _direct; }
+  size_t getChunkSize() const { return _chunkSize; }
+  size_t getChunkCount() const { return _slots.size(); }
+  Slot &getSlot(size_t index) { return *_slots[index % _slots.size()]; }
+
+  // Mark the slot busy before it is submitted, e.g. while it is being filled
+  void reserve(Slot &slot) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    slot.busy = true;
+  }
+
+  // Release a reserved slot that will not be submitted
+  void cancel(Slot &slot) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      slot.busy = false;
+    }
+    _completed.notify_all();
+  }
+
+  void submit(Slot &slot, bool write, off_t offset, size_t size) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      slot.write = write;
+      slot.offset = offset;
+      slot.size = size;
+      slot.transferred = 0;
+      slot.error = 0;
+      slot.busy = true;
+      _queue.push_back(&slot);
+    }
+    _submitted.notify_one();
+  }
+
+  // Wait for all transfers, e.g. before the buffers are freed after an error
+  void drain() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _completed.wait(lock, [&] {
+      return std::none_of(
+          _slots.begin(), _slots.end(),
+          [](const std::unique_ptr<Slot> &slot) { return slot->busy; });
+    });
+  }
+
+  // Wait for the transfer from or to the slot, returns the number of bytes
+  // transferred, which is less than requested at the end of the file
+  size_t wait(Slot &slot) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _completed.wait(lock, [&] { return !slot.busy; });
+    if (slot.error) {
+      throw std::system_error(slot.error, std::generic_category(), _path);
+    }
+    return slot.transferred;
+  }
+
+ private:
+  void run() {
+    while (true) {
+      Slot *slot;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _submitted.wait(lock, [&] { return _stopping || !_queue.empty(); });
+        if (_queue.empty()) {
+          return;
+        }
+        slot = _queue.front();
+        _queue.erase(_queue.begin());
+      }
+      size_t transferred = 0;
+      int error = 0;
+      char *buffer = slot->buffer;
+      while (transferred < slot->size) {
+        const ssize_t result =
+            slot->write
+                ? pwrite(_fd, buffer + transferred, slot->size - transferred,
+                         slot->offset + transferred)
+                : pread(_fd, buffer + transferred, slot->size - transferred,
+                        slot->offset + transferred);
+        if (result < 0 && errno == EINTR) {
+          continue;
+        } else if (result < 0) {
+          error = errno;
+          break;
+        } else if (result == 0) {
+          break;
+        }
+        transferred += result;
+      }
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        slot->transferred = transferred;
+        slot->error = error;
+        slot->busy = false;
+      }
+      _completed.notify_all();
+    }
+  }
+
+  std::string _path;
+  size_t _chunkSize;
+  int _fd;
+  bool _direct;
+  std::vector<std::unique_ptr<Slot>> _slots;
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _submitted;
+  std::condition_variable _completed;
+  std::vector<Slot *> _queue;
+  bool _stopping{false};
+};
+}  // namespace detail
+
+/*
+ * FileLoader
+ *
+ * Loads (part of) a file into device memory. The file is read in chunks with
+ * pread() on I/O threads into a ring of page-locked buffers, and every chunk
+ * is copied to the device as soon as it was read, such that reading from disk
+ * and copying to the device overlap.
+ */
+class FileLoader {
+ public:
+  struct Options {
+    size_t chunkSize{8 << 20};  // must be a multiple of 4096
+    unsigned int chunks{4};
+    unsigned int threads{2};
+    bool direct{false};  // use O_DIRECT, if the file system supports it
+  };
+
+  struct Result {
+    size_t bytes;
+    double seconds;
+    double bandwidth;  // bytes/s
+  };
+
+  explicit FileLoader(const std::string &path)
+      : FileLoader(path, Options()) {}
+
+  FileLoader(const std::string &path, const Options &options)
+      : _ring(path, O_RDONLY, options.chunkSize, options.chunks,
+              options.threads, options.direct) {}
+
+  // Whether the page cache is bypassed
+  bool isDirect() const { return _ring.isDirect(); }
+
+  size_t size() const {
+    struct stat status;
+    if (fstat(_ring.getFileDescriptor(), &status) != 0) {
+      throw std::system_error(errno, std::generic_category(), "fstat");
+    }
+    return status.st_size;
+  }
+
+  // Copy size bytes at offset in the file to dst, returns when the copies
+  // completed on the stream
+  Result load(Stream &stream, CUdeviceptr dst, size_t size, size_t offset = 0) {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t alignment = _ring.isDirect() ? detail::FileRing::alignment : 1;
+    const size_t chunkSize = _ring.getChunkSize();
+    const size_t begin = offset / alignment * alignment;
+    const size_t end = offset + size;
+    const size_t chunks = (end - begin + chunkSize - 1) / chunkSize;
+
+    // Reads chunk i into the slot, the transfer size is rounded up to the
+    // alignment, which is allowed at the end of the file
+    const auto read = [&](size_t chunk) {
+      const size_t chunkBegin = begin + chunk * chunkSize;
+      const size_t bytes = std::min(chunkSize, end - chunkBegin);
+      _ring.submit(_ring.getSlot(chunk), false, chunkBegin,
+                   (bytes + alignment - 1) / alignment * alignment);
+    };
+
+    size_t submitted = std::min(chunks, _ring.getChunkCount());
+    for (size_t chunk = 0; chunk < submitted; chunk++) {
+      read(chunk);
+    }
+    try {
+      for (size_t chunk = 0; chunk < chunks; chunk++) {
+        detail::FileRing::Slot &slot = _ring.getSlot(chunk);
+        const size_t chunkBegin = begin + chunk * chunkSize;
+        const size_t from = std::max(chunkBegin, offset);
+        const size_t to = std::min(chunkBegin + chunkSize, end);
+        if (chunkBegin + _ring.wait(slot) < to) {
+          throw std::runtime_error("FileLoader: unexpected end of file");
+        }
+        const char *buffer = slot.buffer;
+        const CUdeviceptr chunkDst = reinterpret_cast<CUdeviceptr>(
+            reinterpret_cast<char *>(dst) + (from - offset));
+        stream.memcpyHtoDAsync(chunkDst, buffer + (from - chunkBegin),
+                               to - from);
+        slot.event.record(stream);
+
+        // Reuse the slot of the previous chunk once its copy completed,
+        // while the copy of this chunk is queued. With a single slot, the
+        // next chunk can only be read once this chunk was copied.
+        if ((chunk > 0 || _ring.getChunkCount() == 1) && submitted < chunks) {
+          _ring.getSlot(submitted).event.synchronize();
+          read(submitted++);
+        }
+      }
+    } catch (...) {
+      _ring.drain();
+      throw;
+    }
+    if (chunks > 0) {
+      _ring.getSlot(chunks - 1).event.synchronize();
+    }
+
+    Result result{};
+    result.bytes = size;
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    result.bandwidth = result.seconds > 0 ? size / result.seconds : 0;
+    return result;
+  }
+
+  Result load(Stream &stream, DeviceMemory &dst) {
+    return load(stream, dst, std::min(dst.size(), size()));
+  }
+
+ private:
+  detail::FileRing _ring;
+};
+
+/*
+ * FileWriter
+ *
+ * Writes device memory to a file without blocking the stream. Every write is
+ * copied in chunks into a ring of page-locked buffers, and a host function
+ * hands each buffer to an I/O thread once its copy completed. The ring bounds
+ * the amount of data in flight: write() only blocks while all buffers are
+ * still being written to the file. With direct I/O, all writes but the last
+ * must be a multiple of 4096 bytes.
+ */
+class FileWriter {
+ public:
+  struct Options {
+    size_t chunkSize{8 << 20};  // must be a multiple of 4096
+    unsigned int chunks{4};
+    unsigned int threads{2};
+    bool direct{false};  // use O_DIRECT, if the file system supports it
+  };
+
+  explicit FileWriter(const std::string &path)
+      : FileWriter(path, Options()) {}
+
+  FileWriter(const std::string &path, const Options &options)
+      : _ring(path, O_WRONLY | O_CREAT | O_TRUNC, options.chunkSize,
+              options.chunks, options.threads, options.direct) {}
+
+  FileWriter(const FileWriter &) = delete;
+  FileWriter &operator=(const FileWriter &) = delete;
+
+  ~FileWriter() {
+    try {
+      flush();
+    } catch (...) {
+    }
+  }
+
+  bool isDirect() const { return _ring.isDirect(); }
+
+  // Number of bytes written or queued for writing
+  size_t size() const { return _size; }
+
+  // Append size bytes from src to the file once the preceding work on the
+  // stream completed
+  void write(Stream &stream, CUdeviceptr src, size_t size) {
+    const size_t alignment =
+        _ring.isDirect() ? detail::FileRing::alignment : 1;
+    if (_size % alignment != 0) {
+      throw std::invalid_argument(
+          "FileWriter: only the last direct write may be unaligned");
+    }
+    const size_t chunkSize = _ring.getChunkSize();
+    for (size_t offset = 0; offset < size; offset += chunkSize) {
+      const size_t bytes = std::min(chunkSize, size - offset);
+      detail::FileRing::Slot &slot = _ring.getSlot(_next++);
+      _ring.wait(slot);
+      _ring.reserve(slot);
+      try {
+        const CUdeviceptr chunk = reinterpret_cast<CUdeviceptr>(
+            reinterpret_cast<char *>(src) + offset);
+        stream.memcpyDtoHAsync(slot.buffer, chunk, bytes);
+        std::unique_ptr<Task> task(
+            new Task{&_ring, &slot, static_cast<off_t>(_size + offset),
+                     (bytes + alignment - 1) / alignment * alignment});
+        checkCudaCall(cuLaunchHostFunc(stream, submit, task.get()));
+        task.release();
+      } catch (...) {
+        _ring.cancel(slot);
+        throw;
+      }
+    }
+    _size += size;
+  }
+
+  void write(Stream &stream, const DeviceMemory &src) {
+    write(stream, src, src.size());
+  }
+
+  void write(Stream &stream, const DeviceMemory &src, size_t size) {
+    write(stream, static_cast<CUdeviceptr>(src), size);
+  }
+
+  // Wait until all data is written to the file
+  void flush() {
+    for (size_t i = 0; i < _ring.getChunkCount(); i++) {
+      _ring.wait(_ring.getSlot(i));
+    }
+    // Direct writes of the last chunk are rounded up to the alignment
+    if (_ring.isDirect() &&
+        ftruncate(_ring.getFileDescriptor(), _size) != 0) {
+      throw std::system_error(errno, std::generic_category(), "ftruncate");
+    }
+  }
+
+ private:
+  struct Task {
+    detail::FileRing *ring;
+    detail::FileRing::Slot *slot;
+    off_t offset;
+    size_t size;
+  };
+
+  static void submit(void *userData) {
+    std::unique_ptr<Task> task(static_cast<Task *>(userData));
+    task->ring->submit(*task->slot, true, task->offset, task->size);
+  }
+
+  detail::FileRing _ring;
+  size_t _next{0};
+  size_t _size{0};
+};
+#endif
+
+/*
+ * Pipeline
+ *
+ * Processes a sequence of chunks in three stages, upload, compute and
+ * download, such that e.g. chunk i+1 is uploaded while chunk i is computed
+ * and chunk i-1 is downloaded. Every stage has its own stream and every
+ * chunk in flight its own slot of page-locked and device buffers, such that
+ * the memory use is bounded by the number of slots. The stages are functors
+ * that enqueue work on the stream they get, e.g. a copy from the host input
+ * to the device input buffer of the slot. Before the upload stage of a chunk
+ * is called, the host input buffer of its slot is free to be filled.
+ * Completed chunks are passed to an optional completion functor on the host.
+ */
+class Pipeline {
+ public:
+  struct Slot {
+    Slot(size_t inputSize, size_t outputSize)
+        : hostInput(inputSize),
+          hostOutput(outputSize),
+          deviceInput(inputSize),
+          deviceOutput(outputSize) {}
+
+    HostMemory hostInput;
+    HostMemory hostOutput;
+    DeviceMemory deviceInput;
+    DeviceMemory deviceOutput;
+  };
+
+  using Stage = std::function<void(Stream &stream, Slot &slot, size_t chunk)>;
+  using Completion = std::function<void(Slot &slot, size_t chunk)>;
+
+  // Time the streams spent executing each stage, to find the bottleneck
+  struct Statistics {
+    size_t chunks;
+    double seconds;  // wall-clock time of run()
+    double upload;
+    double compute;
+    double download;
+  };
+
+  Pipeline(size_t inputSize, size_t outputSize, Stage upload, Stage compute,
+           Stage download, unsigned int slots = 2)
+      : _stages{std::move(upload), std::move(compute), std::move(download)} {
+    if (inputSize == 0 || outputSize == 0 || slots == 0) {
+      throw std::invalid_argument("Pipeline: sizes and slots must be > 0");
+    }
+    for (unsigned int i = 0; i < slots; i++) {
+      _slots.emplace_back(new SlotState(inputSize, outputSize));
+    }
+    for (size_t stage = 0; stage < stages; stage++) {
+      _streams.emplace_back(CU_STREAM_NON_BLOCKING);
+    }
+  }
+
+  void setCompletion(Completion completion) {
+    _completion = std::move(completion);
+  }
+
+  // Process chunks 0 to chunks - 1, returns when all of them are completed
+  void run(size_t chunks) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+      SlotState &state = getSlot(chunk);
+      if (chunk >= _slots.size()) {
+        complete(chunk - _slots.size());
+      }
+      for (size_t stage = 0; stage < stages; stage++) {
+        Stream &stream = _streams[stage];
+        // Wait for the previous stage of this chunk, and for the next stage of
+        // the previous chunk in this slot, which reads the buffers that this
+        // stage writes
+        if (stage > 0) {
+          stream.wait(state.done[stage - 1]);
+        }
+        if (stage < stages - 1) {
+          stream.wait(state.done[stage + 1]);
+        }
+        state.start[stage].record(stream);
+        _stages[stage](stream, state.slot, chunk);
+        state.done[stage].record(stream);
+      }
+    }
+    for (size_t chunk = chunks > _slots.size() ? chunks - _slots.size() : 0;
+         chunk < chunks; chunk++) {
+      complete(chunk);
+    }
+    _statistics.seconds += std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+  }
+
+  const Statistics &getStatistics() const { return _statistics; }
+
+  Stream &getStream(size_t stage) { return _streams.at(stage); }
+
+ private:
+  static const size_t stages = 3;
+
+  struct SlotState {
+    SlotState(size_t inputSize, size_t outputSize)
+        : slot(inputSize, outputSize) {}
+
+    Slot slot;
+    std::array<Event, stages> start;
+    std::array<Event, stages> done;
+  };
+
+  SlotState &getSlot(size_t chunk) { return *_slots[chunk % _slots.size()]; }
+
+  void complete(size_t chunk) {
+    SlotState &state = getSlot(chunk);
+    state.done[stages - 1].synchronize();
+    _statistics.chunks++;
+    _statistics.upload += state.done[0].elapsedTime(state.start[0]) * 1e-3;
+    _statistics.compute += state.done[1].elapsedTime(state.start[1]) * 1e-3;
+    _statistics.download += state.done[2].elapsedTime(state.start[2]) * 1e-3;
+    if (_completion) {
+      _completion(state.slot, chunk);
+    }
+  }
+
+  std::array<Stage, stages> _stages;
+  std::vector<Stream> _streams;
+  std::vector<std::unique_ptr<SlotState>> _slots;
+  Completion _completion;
+  Statistics _statistics{};
+};
+
+/*
+ * TransferBatcher
+ *
+ * Coalesces many small host-to-device copies, to pay the submission overhead
+ * once per batch rather than once per copy. When a copy is added, its source
+ * is copied into a page-locked staging buffer, such that the caller may reuse
+ * it right away. A batch is flushed with cuMemcpyBatchAsync where the driver
+ * supports it, and otherwise as one bulk copy to a device staging buffer
+ * followed by a kernel that scatters the data to the destinations. Copies are
+ * only enqueued on the stream when the batch is flushed: explicitly, when the
+ * staging buffer is full, or when a copy is added after the batch reached its
+ * size or age threshold. Copies larger than maxTransferSize are not batched.
+ */
+class TransferBatcher {
+ public:
+  struct Options {
+    size_t capacity{1 << 20};  // bytes of staging memory per buffer
+    size_t maxTransferSize{64 << 10};
+    size_t flushSize{256 << 10};
+    std::chrono::microseconds maxDelay{1000};
+    unsigned int buffers{2};  // batches in flight
+    bool useBatchApi{true};   // use cuMemcpyBatchAsync, if supported
+  };
+
+  struct Statistics {
+    size_t copies;   // copies added
+    size_t batches;  // batches flushed
+    size_t bytes;
+  };
+
+  explicit TransferBatcher(Stream &stream)
+      : TransferBatcher(stream, Options()) {}
+
+  TransferBatcher(Stream &stream, const Options &options)
+      : _stream(stream), _options(options) {
+    if (options.buffers == 0 ||
+        options.capacity <
+            options.maxTransferSize + sizeof(Transfer) + alignment) {
+      throw std::invalid_argument(
+          "TransferBatcher: capacity too small for maxTransferSize");
+    }
+    for (unsigned int i = 0; i < options.buffers; i++) {
+      _buffers.emplace_back(new Buffer(options.capacity));
+    }
+    _useBatchApi = options.useBatchApi && isBatchApiSupported();
+  }
+
+  TransferBatcher(const TransferBatcher &) = delete;
+  TransferBatcher &operator=(const TransferBatcher &) = delete;
+
+  ~TransferBatcher() {
+    flush();
+    for (std::unique_ptr<Buffer> &buffer : _buffers) {
+      buffer->done.synchronize();
+    }
+  }
+
+  void memcpyHtoDAsync(CUdeviceptr dst, const void *src, size_t size) {
+    if (size > _options.maxTransferSize) {
+      flush();  // preserve the order of the copies
+      _stream.memcpyHtoDAsync(dst, src, size);
+      return;
+    }
+
+    // The data is packed, followed by the (aligned) descriptors of the copies
+    if (_used + size + alignment + (_transfers.size() + 1) * sizeof(Transfer) >
+        _options.capacity) {
+      flush();
+    }
+    const size_t offset = _used;
+
+    if (_transfers.empty()) {
+      // The buffer is reused once the batch that was flushed from it completed
+      _buffers[_current]->done.synchronize();
+      _first = std::chrono::steady_clock::now();
+    }
+
+    char *host = _buffers[_current]->host;
+    std::memcpy(host + offset, src, size);
+    _transfers.push_back({dst, offset, size});
+    _used = offset + size;
+    _statistics.copies++;
+    _statistics.bytes += size;
+
+    if (_used >= _options.flushSize ||
+        std::chrono::steady_clock::now() - _first >= _options.maxDelay) {
+      flush();
+    }
+  }
+
+  void memcpyHtoDAsync(DeviceMemory &dst, const void *src, size_t size) {
+    memcpyHtoDAsync(static_cast<CUdeviceptr>(dst), src, size);
+  }
+
+  // Enqueue the pending copies on the stream
+  void flush() {
+    if (_transfers.empty()) {
+      return;
+    }
+
+    Buffer &buffer = *_buffers[_current];
+#if defined(__HIP__)
+    flushCopies(buffer);
+#else
+    if (_useBatchApi && static_cast<CUstream>(_stream) != nullptr) {
+      flushBatch(buffer);
+    } else {
+      flushScatter(buffer);
+    }
+#endif
+    buffer.done.record(_stream);
+
+    _transfers.clear();
+    _used = 0;
+    _current = (_current + 1) % _buffers.size();
+    _statistics.batches++;
+  }
+
+  // Number of copies that were added but not yet flushed
+  size_t pending() const { return _transfers.size(); }
+
+  bool usesBatchApi() const { return _useBatchApi; }
+
+  const Statistics &getStatistics() const { return _statistics; }
+
+ private:
+  static const size_t alignment = 8;  // of the descriptors
+
+  // Read by the scatter kernel, the layout must match the PTX below
+  struct Transfer {
+    CUdeviceptr dst;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  struct Buffer {
+    explicit Buffer(size_t capacity) : host(capacity) {}
+
+    HostMemory host;
+    std::unique_ptr<DeviceMemory> device;  // only used by the scatter kernel
+    Event done;
+  };
+
+  static bool isBatchApiSupported() {
+#if !defined(__HIP__) && CUDA_VERSION >= 12080
+    int version{};
+    checkCudaCall(cuDriverGetVersion(&version));
+    return version >= 12080;
+#else
+    return false;
+#endif
+  }
+
+#if defined(__HIP__)
+  void flushCopies(Buffer &buffer) {
+    char *host = buffer.host;
+    for (const Transfer &transfer : _transfers) {
+      _stream.memcpyHtoDAsync(transfer.dst, host + transfer.offset,
+                              transfer.size);
+    }
+  }
+#else
+#if CUDA_VERSION >= 12080
+  void flushBatch(Buffer &buffer) {
+    const size_t count = _transfers.size();
+    std::vector<CUdeviceptr> dsts(count);
+    std::vector<CUdeviceptr> srcs(count);
+    std::vector<size_t> sizes(count);
+    const char *host = buffer.host;
+    for (size_t i = 0; i < count; i++) {
+      dsts[i] = _transfers[i].dst;
+      srcs[i] = reinterpret_cast<CUdeviceptr>(host + _transfers[i].offset);
+      sizes[i] = _transfers[i].size;
+    }
+
+    CUmemcpyAttributes attributes{};
+    attributes.srcAccessOrder = CU_MEMCPY_SRC_ACCESS_ORDER_STREAM;
+    size_t attributesIndex = 0;
+#if CUDA_VERSION >= 13000
+    checkCudaCall(cuMemcpyBatchAsync(dsts.data(), srcs.data(), sizes.data(),
+                                     count, &attributes, &attributesIndex, 1,
+                                     _stream));
+#else
+    size_t failIndex;
+    checkCudaCall(cuMemcpyBatchAsync(dsts.data(), srcs.data(), sizes.data(),
+                                     count, &attributes, &attributesIndex, 1,
+                                     &failIndex, _stream));
+#endif
+    detail::count(getCounters().bytesCopiedHtoD, _used);
+  }
+#else
+  void flushBatch(Buffer &buffer) { flushScatter(buffer); }
+#endif
+
+  void flushScatter(Buffer &buffer) {
+    if (!_scatter) {
+      _module.reset(new Module(static_cast<const void *>(getScatterPtx())));
+      _scatter.reset(new Function(*_module, "scatter"));
+    }
+    if (!buffer.device) {
+      buffer.device.reset(new DeviceMemory(_options.capacity));
+    }
+
+    // The descriptors of the copies are appended to the data, such that both
+    // are uploaded with a single copy
+    const size_t count = _transfers.size();
+    const size_t table = (_used + alignment - 1) / alignment * alignment;
+    char *host = buffer.host;
+    std::memcpy(host + table, _transfers.data(), count * sizeof(Transfer));
+    _stream.memcpyHtoDAsync(*buffer.device, host,
+                            table + count * sizeof(Transfer));
+
+    const CUdeviceptr data = *buffer.device;
+    const CUdeviceptr descriptors =
+        reinterpret_cast<CUdeviceptr>(reinterpret_cast<char *>(data) + table);
+    const unsigned int n = count;
+    _stream.launchKernel(*_scatter, n, 1, 1, 128, 1, 1, 0,
+                         {&descriptors, &data, &n});
+  }
+
+  // One block per copy, copies bytewise as the destinations may be unaligned
+  static const char *getScatterPtx() {
+    return R"(
+.version 6.0
+.target sm_50
+.address_size 64
+
+.visible .entry scatter(.param .u64 descriptors, .param .u64 data,
+                        .param .u32 count) {
+  .reg .pred %p<3>;
+  .reg .b16 %rs<2>;
+  .reg .b32 %r<5>;
+  .reg .b64 %rd<15>;
+
+  ld.param.u64 %rd1, [descriptors];
+  ld.param.u64 %rd2, [data];
+  ld.param.u32 %r1, [count];
+  mov.u32 %r2, %ctaid.x;
+  setp.ge.u32 %p1, %r2, %r1;
+  @%p1 bra DONE;
+
+  cvta.to.global.u64 %rd3, %rd1;
+  mul.wide.u32 %rd4, %r2, 24;
+  add.s64 %rd5, %rd3, %rd4;
+  ld.global.u64 %rd6, [%rd5];
+  ld.global.u64 %rd7, [%rd5+8];
+  ld.global.u64 %rd8, [%rd5+16];
+  cvta.to.global.u64 %rd9, %rd2;
+  add.s64 %rd9, %rd9, %rd7;
+  cvta.to.global.u64 %rd10, %rd6;
+  mov.u32 %r3, %tid.x;
+  cvt.u64.u32 %rd11, %r3;
+  mov.u32 %r4, %ntid.x;
+  cvt.u64.u32 %rd12, %r4;
+
+LOOP:
+  setp.ge.u64 %p2, %rd11, %rd8;
+  @%p2 bra DONE;
+  add.s64 %rd13, %rd9, %rd11;
+  ld.global.u8 %rs1, [%rd13];
+  add.s64 %rd14, %rd10, %rd11;
+  st.global.u8 [%rd14], %rs1;
+  add.s64 %rd11, %rd11, %rd12;
+  bra LOOP;
+
+DONE:
+  ret;
+}
+)";
+  }
+#endif
+
+  Stream _stream;
+  Options _options;
+  std::vector<std::unique_ptr<Buffer>> _buffers;
+  size_t _current{0};
+  std::vector<Transfer> _transfers;
+  size_t _used{0};
+  std::chrono::steady_clock::time_point _first;
+  bool _useBatchApi{false};
+  std::unique_ptr<Module> _module;
+  std::unique_ptr<Function> _scatter;
+  Statistics _statistics{};
+};
+
+/*
+ * CopyScheduler
+ *
+ * Issues a queue of host-to-device and device-to-host copies on two streams
+ * of its own, such that both copy engines are kept busy. The copies are split
+ * into chunks that are issued alternately for both directions. A copy waits
+ * for the last earlier copy in the other direction of which the device or
+ * host range overlaps with its own, such that the order of the copies per
+ * buffer is preserved. Copies in the same direction run in queue order.
+ */
+class CopyScheduler {
+ public:
+  struct Options {
+    size_t chunkSize{8 << 20};
+  };
+
+  struct Result {
+    size_t bytesHtoD;
+    size_t bytesDtoH;
+    double secondsHtoD;
+    double secondsDtoH;
+    double seconds;    // from the first to the last copy in either direction
+    double bandwidth;  // aggregate, bytes/s
+  };
+
+  CopyScheduler() : CopyScheduler(Options()) {}
+
+  explicit CopyScheduler(const Options &options) : _options(options) {
+    if (options.chunkSize == 0) {
+      throw std::invalid_argument("CopyScheduler: chunkSize must be > 0");
+    }
+    for (size_t direction = 0; direction < directions; direction++) {
+      _streams.emplace_back(CU_STREAM_NON_BLOCKING);
+    }
+  }
+
+  void memcpyHtoDAsync(CUdeviceptr dst, const void *src, size_t size) {
+    _transfers.push_back({HtoD, dst, const_cast<void *>(src), size});
+  }
+
+  void memcpyHtoDAsync(DeviceMemory &dst, const void *src, size_t size) {
+    memcpyHtoDAsync(static_cast<CUdeviceptr>(dst), src, size);
+  }
+
+  void memcpyDtoHAsync(void *dst, CUdeviceptr src, size_t size) {
+    _transfers.push_back({DtoH, src, dst, size});
+  }
+
+  void memcpyDtoHAsync(void *dst, const DeviceMemory &src, size_t size) {
+    memcpyDtoHAsync(dst, static_cast<CUdeviceptr>(src), size);
+  }
+
+  // Issue the queued copies after the work in stream, later work in stream
+  // waits for the copies to complete
+  void enqueue(Stream &stream) {
+    if (_transfers.empty()) {
+      return;
+    }
+
+    findDependencies();
+    _begin.record(stream);
+    for (size_t direction = 0; direction < directions; direction++) {
+      _streams[direction].wait(_begin);
+      if (!_pending) {
+        _start[direction].record(_streams[direction]);
+      }
+    }
+
+    // Per direction, the index of the next transfer and the offset in it
+    std::array<size_t, directions> next{0, 0};
+    std::array<size_t, directions> offset{0, 0};
+    std::vector<bool> issued(_transfers.size(), false);
+    size_t remaining = _transfers.size();
+    while (remaining > 0) {
+      for (size_t direction = 0; direction < directions; direction++) {
+        size_t &i = next[direction];
+        while (i < _transfers.size() &&
+               _transfers[i].direction != direction) {
+          i++;
+        }
+        if (i == _transfers.size()) {
+          continue;
+        }
+
+        Transfer &transfer = _transfers[i];
+        Stream &copyStream = _streams[direction];
+        if (offset[direction] == 0 && transfer.dependency != none) {
+          if (!issued[transfer.dependency]) {
+            continue;  // the other direction issues the dependency first
+          }
+          copyStream.wait(_events[transfer.dependency]);
+        }
+
+        const size_t size =
+            std::min(_options.chunkSize, transfer.size - offset[direction]);
+        const CUdeviceptr device = reinterpret_cast<CUdeviceptr>(
+            reinterpret_cast<char *>(transfer.device) + offset[direction]);
+        char *host = static_cast<char *>(transfer.host) + offset[direction];
+        if (direction == HtoD) {
+          copyStream.memcpyHtoDAsync(device, host, size);
+        } else {
+          copyStream.memcpyDtoHAsync(host, device, size);
+        }
+        _bytes[direction] += size;
+        offset[direction] += size;
+
+        if (offset[direction] == transfer.size) {
+          if (transfer.hasDependents) {
+            _events[i].record(copyStream);
+          }
+          issued[i] = true;
+          remaining--;
+          offset[direction] = 0;
+          i++;
+        }
+      }
+    }
+
+    for (size_t direction = 0; direction < directions; direction++) {
+      _end[direction].record(_streams[direction]);
+      stream.wait(_end[direction]);
+    }
+    _transfers.clear();
+    _pending = true;
+  }
+
+  // Wait for the copies that were enqueued since the last call, and report
+  // the achieved bandwidth
+  Result synchronize() {
+    Result result{};
+    if (!_pending) {
+      return result;
+    }
+
+    for (size_t direction = 0; direction < directions; direction++) {
+      _end[direction].synchronize();
+    }
+    result.bytesHtoD = _bytes[HtoD];
+    result.bytesDtoH = _bytes[DtoH];
+    result.secondsHtoD = _end[HtoD].elapsedTime(_start[HtoD]) * 1e-3;
+    result.secondsDtoH = _end[DtoH].elapsedTime(_start[DtoH]) * 1e-3;
+    result.seconds = std::max(_end[HtoD].elapsedTime(_start[HtoD]),
+                              _end[DtoH].elapsedTime(_start[HtoD])) *
+                     1e-3;
+    if (result.seconds > 0) {
+      result.bandwidth =
+          (result.bytesHtoD + result.bytesDtoH) / result.seconds;
+    }
+
+    _bytes = {0, 0};
+    _pending = false;
+    return result;
+  }
+
+ private:
+  enum : size_t { HtoD, DtoH, directions };
+
+  static const size_t none = std::numeric_limits<size_t>::max();
+
+  struct Transfer {
+    size_t direction;
+    CUdeviceptr device;
+    void *host;
+    size_t size;
+    size_t dependency;
+    bool hasDependents;
+  };
+
+  static bool overlaps(const char *a, size_t sizeA, const char *b,
+                       size_t sizeB) {
+    return a < b + sizeB && b < a + sizeA;
+  }
+
+  // Find, for every transfer, the last earlier transfer in the other
+  // direction that accesses the same device or host memory
+  void findDependencies() {
+    for (size_t i = 0; i < _transfers.size(); i++) {
+      Transfer &transfer = _transfers[i];
+      transfer.dependency = none;
+      transfer.hasDependents = false;
+      for (size_t j = i; j-- > 0;) {
+        const Transfer &other = _transfers[j];
+        if (other.direction != transfer.direction &&
+            (overlaps(reinterpret_cast<const char *>(transfer.device),
+                      transfer.size,
+                      reinterpret_cast<const char *>(other.device),
+                      other.size) ||
+             overlaps(static_cast<const char *>(transfer.host), transfer.size,
+                      static_cast<const char *>(other.host), other.size))) {
+          transfer.dependency = j;
+          _transfers[j].hasDependents = true;
+          break;
+        }
+      }
+    }
+    while (_events.size() < _transfers.size()) {
+      _events.emplace_back(CU_EVENT_DISABLE_TIMING);
+    }
+  }
+
+  Options _options;
+  std::vector<Stream> _streams;
+  std::vector<Transfer> _transfers;
+  std::vector<Event> _events;
+  Event _begin{CU_EVENT_DISABLE_TIMING};
+  std::array<Event, directions> _start;
+  std::array<Event, directions> _end;
+  std::array<size_t, directions> _bytes{{0, 0}};
+  bool _pending{false};
+};
+
+/*
+ * ManagedStreamer
+ *
+ * Processes managed memory that may exceed the device memory in windows.
+ * While window k is processed on the stream, window k+1 is prefetched to the
+ * device and window k-1 is evicted to the host on a stream of its own, such
+ * that the kernels find their data resident rather than migrating it page by
+ * page on demand. The time the stream spent waiting for a prefetch is
+ * reported as the stall time: if it is a significant part of the total, the
+ * windows are processed faster than they can be migrated.
+ */
+class ManagedStreamer {
+ public:
+  using Kernel =
+      std::function<void(Stream &stream, DeviceMemory &window, size_t index)>;
+
+  struct Statistics {
+    size_t windows;
+    size_t bytesPrefetched;
+    size_t bytesEvicted;
+    double seconds;  // wall-clock time of run()
+    double prefetchSeconds;
+    double computeSeconds;
+    double stallSeconds;  // waiting for prefetches to complete
+    double bandwidth;     // bytes prefetched per second of run()
+  };
+
+  ManagedStreamer(DeviceMemory &memory, size_t windowSize,
+                  const Device &device, bool evict = true)
+      : _memory(memory),
+        _size(memory.size()),
+        _windowSize(windowSize),
+        _device(device),
+        _evict(evict),
+        _stream(CU_STREAM_NON_BLOCKING) {
+    if (windowSize == 0) {
+      throw std::invalid_argument("ManagedStreamer: windowSize must be > 0");
+    }
+  }
+
+  size_t getWindowCount() const {
+    return (_size + _windowSize - 1) / _windowSize;
+  }
+
+  // Call kernel for every window in order, returns when all of them are
+  // processed
+  void run(Stream &stream, const Kernel &kernel) {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t windows = getWindowCount();
+    if (windows == 0) {
+      return;
+    }
+
+    _begin.record(stream);
+    _stream.wait(_begin);
+    prefetch(0);
+
+    for (size_t k = 0; k < windows; k++) {
+      if (k >= 2) {
+        accumulate(k - 2);  // its slot is reused for window k + 1
+      }
+      if (k >= 1) {
+        evict(k - 1);
+      }
+      if (k + 1 < windows) {
+        prefetch(k + 1);
+      }
+
+      Slot &slot = getSlot(k);
+      DeviceMemory window = getWindow(k);
+      slot.stall.record(stream);
+      stream.wait(slot.ready);
+      slot.compute.record(stream);
+      kernel(stream, window, k);
+      slot.done.record(stream);
+    }
+
+    evict(windows - 1);
+    _end.record(_stream);
+    stream.wait(_end);
+    for (size_t k = windows >= 2 ? windows - 2 : 0; k < windows; k++) {
+      accumulate(k);
+    }
+    _end.synchronize();
+
+    _statistics.seconds += std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    _statistics.bandwidth = _statistics.bytesPrefetched / _statistics.seconds;
+  }
+
+  const Statistics &getStatistics() const { return _statistics; }
+
+ private:
+  static const size_t slots = 3;
+
+  struct Slot {
+    Event prefetch;
+    Event ready;
+    Event stall;
+    Event compute;
+    Event done;
+  };
+
+  Slot &getSlot(size_t k) { return _slots[k % slots]; }
+
+  DeviceMemory getWindow(size_t k) {
+    const size_t offset = k * _windowSize;
+    return DeviceMemory(_memory, offset, std::min(_windowSize, _size - offset));
+  }
+
+  void prefetch(size_t k) {
+    Slot &slot = getSlot(k);
+    DeviceMemory window = getWindow(k);
+    slot.prefetch.record(_stream);
+    _stream.memPrefetchAsync(window, window.size(), _device);
+    slot.ready.record(_stream);
+    _statistics.bytesPrefetched += window.size();
+  }
+
+  // Evict window k to the host once it was processed
+  void evict(size_t k) {
+    _stream.wait(getSlot(k).done);
+    if (_evict) {
+      DeviceMemory window = getWindow(k);
+      _stream.memPrefetchAsync(window, window.size());
+      _statistics.bytesEvicted += window.size();
+    }
+  }
+
+  void accumulate(size_t k) {
+    Slot &slot = getSlot(k);
+    slot.done.synchronize();
+    _statistics.windows++;
+    _statistics.prefetchSeconds += slot.ready.elapsedTime(slot.prefetch) * 1e-3;
+    _statistics.stallSeconds += slot.compute.elapsedTime(slot.stall) * 1e-3;
+    _statistics.computeSeconds += slot.done.elapsedTime(slot.compute) * 1e-3;
+  }
+
+  DeviceMemory _memory;
+  size_t _size;
+  size_t _windowSize;
+  Device _device;
+  bool _evict;
+  Stream _stream;
+  Event _begin{CU_EVENT_DISABLE_TIMING};
+  Event _end{CU_EVENT_DISABLE_TIMING};
+  std::array<Slot, slots> _slots;
+  Statistics _statistics{};
+};
+
+namespace detail {
+// A set of disjoint ranges [begin, end), overlapping and adjacent ranges are
+// merged
+class RangeSet {
+ public:
+  using const_iterator = std::map<size_t, size_t>::const_iterator;
+
+  void add(size_t begin, size_t end) {
+    if (begin >= end) {
+      return;
+    }
+    auto it = _ranges.upper_bound(begin);
+    if (it != _ranges.begin() && std::prev(it)->second >= begin) {
+      --it;
+      begin = it->first;
+    }
+    while (it != _ranges.end() && it->first <= end) {
+      end = std::max(end, it->second);
+      it = _ranges.erase(it);
+    }
+    _ranges.emplace(begin, end);
+  }
+
+  void subtract(size_t begin, size_t end) {
+    auto it = _ranges.upper_bound(begin);
+    if (it != _ranges.begin()) {
+      --it;
+    }
+    while (it != _ranges.end() && it->first < end) {
+      const size_t rangeBegin = it->first;
+      const size_t rangeEnd = it->second;
+      if (rangeEnd <= begin) {
+        ++it;
+        continue;
+      }
+      it = _ranges.erase(it);
+      if (rangeBegin < begin) {
+        _ranges.emplace(rangeBegin, begin);
+      }
+      if (rangeEnd > end) {
+        _ranges.emplace(end, rangeEnd);
+      }
+    }
+  }
+
+  void clear() { _ranges.clear(); }
+
+  bool empty() const { return _ranges.empty(); }
+
+  const_iterator begin() const { return _ranges.begin(); }
+
+  const_iterator end() const { return _ranges.end(); }
+
+ private:
+  std::map<size_t, size_t> _ranges;
+};
+}  // namespace detail
+
+/*
+ * MirroredBuffer
+ *
+ * An array of count elements of type T with a copy in page-locked host
+ * memory and a copy in device memory. Writes to either copy are reported
+ * with markHostDirty() or markDeviceDirty(), after which that copy is
+ * authoritative for the written range. deviceView() and hostView() copy only
+ * the ranges in which the other copy is newer, asynchronously on the given
+ * stream, and copy nothing if both copies are coherent. The host copy may be
+ * accessed once the stream passed to hostView() is synchronized.
+ */
+template <typename T>
+class MirroredBuffer {
+ public:
+  struct Statistics {
+    size_t bytesCopiedHtoD;
+    size_t bytesCopiedDtoH;
+    size_t copies;
+  };
+
+  explicit MirroredBuffer(size_t count, unsigned int flags = 0)
+      : _count(count),
+        _host(count * sizeof(T), flags),
+        _device(count * sizeof(T)) {}
+
+  size_t size() const { return _count; }
+
+  void markHostDirty() { markHostDirty(0, _count); }
+
+  void markHostDirty(size_t offset, size_t count) {
+    checkRange(offset, count);
+    _hostDirty.add(offset, offset + count);
+    _deviceDirty.subtract(offset, offset + count);
+  }
+
+  void markDeviceDirty() { markDeviceDirty(0, _count); }
+
+  void markDeviceDirty(size_t offset, size_t count) {
+    checkRange(offset, count);
+    _deviceDirty.add(offset, offset + count);
+    _hostDirty.subtract(offset, offset + count);
+  }
+
+  bool isCoherent() const { return _hostDirty.empty() && _deviceDirty.empty(); }
+
+  // Copy the ranges that are newer on the host to the device
+  DeviceMemory &deviceView(Stream &stream) {
+    T *host = _host;
+    for (const std::pair<const size_t, size_t> &range : _hostDirty) {
+      const size_t bytes = (range.second - range.first) * sizeof(T);
+      DeviceMemory device(_device, range.first * sizeof(T), bytes);
+      stream.memcpyHtoDAsync(device, host + range.first, bytes);
+      _statistics.bytesCopiedHtoD += bytes;
+      _statistics.copies++;
+    }
+    _hostDirty.clear();
+    return _device;
+  }
+
+  // Copy the ranges that are newer on the device to the host
+  T *hostView(Stream &stream) {
+    T *host = _host;
+    for (const std::pair<const size_t, size_t> &range : _deviceDirty) {
+      const size_t bytes = (range.second - range.first) * sizeof(T);
+      DeviceMemory device(_device, range.first * sizeof(T), bytes);
+      stream.memcpyDtoHAsync(host + range.first, device, bytes);
+      _statistics.bytesCopiedDtoH += bytes;
+      _statistics.copies++;
+    }
+    _deviceDirty.clear();
+    return host;
+  }
+
+  // The copies themselves, without synchronizing them
+  HostMemory &getHostMemory() { return _host; }
+
+  DeviceMemory &getDeviceMemory() { return _device; }
+
+  const Statistics &getStatistics() const { return _statistics; }
+
+ private:
+  void checkRange(size_t offset, size_t count) const {
+    if (offset + count > _count) {
+      throw Error(CUDA_ERROR_INVALID_VALUE);
+    }
+  }
+
+  size_t _count;
+  HostMemory _host;
+  DeviceMemory _device;
+  detail::RangeSet _hostDirty;
+  detail::RangeSet _deviceDirty;
+  Statistics _statistics{};
+};
+
+/*
+ * DeviceArena
+ *
+ * Hands out sub-allocations of one large device allocation by incrementing
+ * an offset, for scratch buffers that live until the end of a frame. The
+ * arena makes no driver calls per allocation. reset(stream) releases all
+ * allocations at the point in the stream where the frame's work ends: work
+ * that is enqueued later on the same stream may use new allocations right
+ * away, other streams should wait() for the reset first.
+ */
+class DeviceArena {
+ public:
+  struct Statistics {
+    size_t frames;
+    size_t allocations;
+    size_t lastFramePeak;  // bytes used by the last frame
+    size_t peak;           // maximum over all frames
+  };
+
+  explicit DeviceArena(size_t capacity, size_t alignment = 256)
+      : _memory(capacity), _alignment(alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+      throw std::invalid_argument(
+          "DeviceArena: alignment must be a power of two");
+    }
+  }
+
+  DeviceMemory allocate(size_t size) {
+    const size_t offset = (_used + _alignment - 1) & ~(_alignment - 1);
+    if (offset > _memory.size() || size > _memory.size() - offset) {
+      throw Error(CUDA_ERROR_OUT_OF_MEMORY);
+    }
+    _used = offset + size;
+    _statistics.allocations++;
+    _statistics.peak = std::max(_statistics.peak, _used);
+    return DeviceMemory(_memory, offset, size);
+  }
+
+  template <typename T>
+  DeviceMemory allocate(size_t count) {
+    return allocate(count * sizeof(T));
+  }
+
+  // End the frame once the work in stream completes
+  void reset(Stream &stream) {
+    _released.record(stream);
+    _statistics.frames++;
+    _statistics.lastFramePeak = _used;
+    _used = 0;
+  }
+
+  // Make stream wait until the last frame released its allocations
+  void wait(Stream &stream) { stream.wait(_released); }
+
+  void synchronize() { _released.synchronize(); }
+
+  size_t getCapacity() const { return _memory.size(); }
+
+  size_t getUsed() const { return _used; }
+
+  const Statistics &getStatistics() const { return _statistics; }
+
+ private:
+  DeviceMemory _memory;
+  size_t _alignment;
+  size_t _used{0};
+  Event _released{CU_EVENT_DISABLE_TIMING};
+  Statistics _statistics{};
+};
+
+// The load on a device, as reported by e.g. nvml::DeviceLoadSource
+struct DeviceLoad {
+  double utilization;      // fraction of time the device was busy
+  size_t freeMemory;       // bytes
+  size_t totalMemory;      // bytes
+  double power;            // watts
+  double powerLimit;       // watts, zero if unknown
+  unsigned int processes;  // number of processes using the device
+};
+
+/*
+ * DeviceSelector
+ *
+ * Ranks devices by their load, such that new work can be placed on the least
+ * loaded device that has enough free memory. The load of a device is queried
+ * through a user-provided function, e.g. nvml::DeviceLoadSource. The selector
+ * sticks to the device it selected before, unless another device scores
+ * better by more than the hysteresis margin.
+ */
+class DeviceSelector {
+ public:
+  using LoadFunction = std::function<DeviceLoad(int ordinal)>;
+
+  // Contribution of each load metric to the score, lower scores are better
+  struct Weights {
+    double utilization{1.0};
+    double memory{1.0};  // used fraction of device memory
+    double power{0.5};   // fraction of the power limit
+    double processes{0.25};
+    double hysteresis{0.1};
+  };
+
+  DeviceSelector(int count, LoadFunction load)
+      : DeviceSelector(count, std::move(load), Weights()) {}
+
+  DeviceSelector(int count, LoadFunction load, const Weights &weights)
+      : _count(count), _load(std::move(load)), _weights(weights) {}
+
+  double score(const DeviceLoad &load) const {
+    double score = _weights.utilization * load.utilization +
+                   _weights.processes * load.processes;
+    if (load.totalMemory > 0) {
+      score += _weights.memory *
+               (1.0 - static_cast<double>(load.freeMemory) / load.totalMemory);
+    }
+    if (load.powerLimit > 0) {
+      score += _weights.power * load.power / load.powerLimit;
+    }
+    return score;
+  }
+
+  // Ordinals of the devices with at least requiredMemory free, best first
+  std::vector<int> rank(size_t requiredMemory = 0) const {
+    std::vector<std::pair<double, int>> scores;
+    for (int ordinal = 0; ordinal < _count; ordinal++) {
+      const DeviceLoad load = _load(ordinal);
+      if (load.freeMemory >= requiredMemory) {
+        scores.emplace_back(score(load), ordinal);
+      }
+    }
+    std::stable_sort(scores.begin(), scores.end());
+    std::vector<int> ordinals;
+    for (const std::pair<double, int> &entry : scores) {
+      ordinals.push_back(entry.second);
+    }
+    return ordinals;
+  }
+
+  int selectOrdinal(size_t requiredMemory = 0) {
+    int best = -1;
+    double bestScore = 0;
+    double previousScore = 0;
+    bool previousFits = false;
+    for (int ordinal = 0; ordinal < _count; ordinal++) {
+      const DeviceLoad load = _load(ordinal);
+      if (load.freeMemory < requiredMemory) {
+        continue;
+      }
+      const double current = score(load);
+      if (best < 0 || current < bestScore) {
+        best = ordinal;
+        bestScore = current;
+      }
+      if (ordinal == _previous) {
+        previousFits = true;
+        previousScore = current;
+      }
+    }
+    if (best < 0) {
+      throw Error(CUDA_ERROR_OUT_OF_MEMORY);
+    }
+    if (previousFits && previousScore <= bestScore + _weights.hysteresis) {
+      best = _previous;
+    }
+    _previous = best;
+    return best;
+  }
+
+  Device select(size_t requiredMemory = 0) {
+    return Device(selectOrdinal(requiredMemory));
+  }
+
+ private:
+  int _count;
+  LoadFunction _load;
+  Weights _weights;
+  int _previous{-1};
+};
 }  // namespace cu
 
 #endif
\ No newline at end of file
@@ -13,6 +13,7 @@
 
 #include <array>
 #include <exception>
+#include <memory>
 
 #include "cudawrappers/cu.hpp"
 
@@ -94,6 +95,12 @@ class Error : public std::exception {
 
 /*
  * FFT
+ *
+ * The work area of a plan is allocated when the plan is created, so executing
+ * a plan does not allocate memory. A plan that is bound to the stream it runs
+ * on can therefore be executed while that stream is captured into a CUDA
+ * graph. Every FFT type can be bound to a stream at construction by passing
+ * the stream as first argument, e.g. FFT1D<CUDA_C_32F> fft(stream, nx).
  */
 class FFT {
  public:
@@ -103,16 +110,40 @@ class FFT {
   FFT &operator=(FFT &&other) noexcept {
     if (&other != this) {
       plan_ = other.plan_;
+      stream_ = other.stream_;
+      workArea_ = std::move(other.workArea_);
       other.plan_ = 0;
     }
     return *this;
   }
   FFT(FFT &&other) noexcept { *this = std::move(other); }
 
-  ~FFT() { checkCuFFTCall(cufftDestroy(plan_)); }
+  ~FFT() {
+    if (plan_) {
+      cufftDestroy(plan_);
+    }
+  }
 
-  void setStream(cu::Stream &stream) const {
+  void setStream(cu::Stream &stream) {
     checkCuFFTCall(cufftSetStream(plan_, stream));
+    stream_ = stream;
+  }
+
+  size_t getWorkSize() const {
+    size_t size{};
+    checkCuFFTCall(cufftGetSize(plan_, &size));
+    return size;
+  }
+
+  // Replace the work area allocated by cuFFT, e.g. to share one work area
+  // between plans that never run concurrently. The plan keeps workArea alive.
+  void setWorkArea(cu::DeviceMemory &workArea) {
+    if (workArea.size() < getWorkSize()) {
+      throw Error(CUFFT_INVALID_VALUE);
+    }
+    void *ptr = reinterpret_cast<void *>(static_cast<CUdeviceptr>(workArea));
+    checkCuFFTCall(cufftSetWorkArea(plan_, ptr));
+    workArea_ = std::make_shared<cu::DeviceMemory>(workArea);
   }
 
   void execute(cu::DeviceMemory &in, cu::DeviceMemory &out,
@@ -122,7 +153,22 @@ class FFT {
     checkCuFFTCall(cufftXtExec(plan_, in_ptr, out_ptr, direction));
   }
 
+  // Execute on the given stream, which may be capturing. Rebinding the plan
+  // only touches host-side state, so the execution is the only work that
+  // ends up in the stream (or graph).
+  void execute(cu::DeviceMemory &in, cu::DeviceMemory &out,
+               const int direction, cu::Stream &stream) {
+    if (static_cast<CUstream>(stream) != stream_) {
+      setStream(stream);
+    }
+    execute(in, out, direction);
+  }
+
  protected:
+  // Construct after the arguments of a derived class are validated, which
+  // throws before there is a plan to destroy
+  explicit FFT(cufftResult arguments) { checkCuFFTCall(arguments); }
+
   void checkCuFFTCall(cufftResult result) const {
     if (result != CUFFT_SUCCESS) {
       throw Error(result);
@@ -133,6 +179,8 @@ class FFT {
 
  private:
   cufftHandle plan_{};
+  CUstream stream_{};
+  std::shared_ptr<cu::DeviceMemory> workArea_;
 };
 
 /*
@@ -143,6 +191,16 @@ class FFT1D : public FFT {
  public:
 #if defined(__HIP__)
   __host__
+#endif
+  FFT1D(cu::Stream &stream, const int nx) : FFT1D(nx) { setStream(stream); }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT1D(cu::Stream &stream, const int nx, const int batch) : FFT1D(nx, batch) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
 #endif
   FFT1D(const int nx) = delete;
 #if defined(__HIP__)
@@ -186,6 +244,20 @@ class FFT2D : public FFT {
  public:
 #if defined(__HIP__)
   __host__
+#endif
+  FFT2D(cu::Stream &stream, const int nx, const int ny) : FFT2D(nx, ny) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2D(cu::Stream &stream, const int nx, const int ny, const int stride,
+        const int dist, const int batch)
+      : FFT2D(nx, ny, stride, dist, batch) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
 #endif
   FFT2D(const int nx, const int ny) = delete;
 #if defined(__HIP__)
@@ -238,6 +310,14 @@ class FFT1DR2C : public FFT {
  public:
 #if defined(__HIP__)
   __host__
+#endif
+  FFT1DR2C(cu::Stream &stream, const int nx, const int batch, long long inembed,
+           long long ouembed)
+      : FFT1DR2C(nx, batch, inembed, ouembed) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
 #endif
   FFT1DR2C(const int nx) = delete;
 #if defined(__HIP__)
@@ -277,6 +357,14 @@ class FFT1DC2R : public FFT {
  public:
 #if defined(__HIP__)
   __host__
+#endif
+  FFT1DC2R(cu::Stream &stream, const int nx, const int batch, long long inembed,
+           long long ouembed)
+      : FFT1DC2R(nx, batch, inembed, ouembed) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
 #endif
   FFT1DC2R(const int nx) = delete;
 #if defined(__HIP__)
@@ -307,6 +395,216 @@ FFT1DC2R<CUDA_C_32F>::FFT1DC2R(const int nx, const int batch, long long inembed,
       ostride, odist, CUDA_R_32F, batch, &ws, CUDA_C_32F));
 }
 
+/*
+ * FFT2DR2C
+ *
+ * The real input has nx rows of ny elements; the Hermitian-symmetric output
+ * has nx rows of ny / 2 + 1 complex elements. Rows may be padded by passing
+ * the row pitch (in elements) of the input and output through inembed and
+ * ouembed; consecutive batches are nx rows apart. For an in-place transform,
+ * use inembed = 2 * (ny / 2 + 1) and ouembed = ny / 2 + 1.
+ */
+template <cudaDataType_t T>
+class FFT2DR2C : public FFT {
+ public:
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DR2C(cu::Stream &stream, const int nx, const int ny) : FFT2DR2C(nx, ny) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DR2C(cu::Stream &stream, const int nx, const int ny, const int batch)
+      : FFT2DR2C(nx, ny, batch) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DR2C(cu::Stream &stream, const int nx, const int ny, const int batch,
+           long long inembed, long long ouembed)
+      : FFT2DR2C(nx, ny, batch, inembed, ouembed) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DR2C(const int nx, const int ny) = delete;
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DR2C(const int nx, const int ny, const int batch) = delete;
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DR2C(const int nx, const int ny, const int batch, long long inembed,
+           long long ouembed) = delete;
+
+ private:
+  static cufftResult checkPadding(const int ny, long long inembed,
+                                  long long ouembed) {
+    if (inembed < ny || ouembed < ny / 2 + 1) {
+      return CUFFT_INVALID_SIZE;
+    }
+    return CUFFT_SUCCESS;
+  }
+
+  void makePlan(const int nx, const int ny, const int batch, long long inembed,
+                long long ouembed, cudaDataType_t inputType,
+                cudaDataType_t outputType) {
+    checkCuFFTCall(cufftCreate(plan()));
+    const int rank = 2;
+    size_t ws = 0;
+    std::array<long long, 2> n{nx, ny};
+    std::array<long long, 2> inembed_{nx, inembed};
+    std::array<long long, 2> ouembed_{nx, ouembed};
+    const long long idist = nx * inembed;
+    const long long odist = nx * ouembed;
+    const long long istride = 1;
+    const long long ostride = 1;
+
+    checkCuFFTCall(cufftXtMakePlanMany(
+        *plan(), rank, n.data(), inembed_.data(), istride, idist, inputType,
+        ouembed_.data(), ostride, odist, outputType, batch, &ws, outputType));
+  }
+};
+
+template <>
+FFT2DR2C<CUDA_R_32F>::FFT2DR2C(const int nx, const int ny, const int batch,
+                               long long inembed, long long ouembed)
+    : FFT(checkPadding(ny, inembed, ouembed)) {
+  makePlan(nx, ny, batch, inembed, ouembed, CUDA_R_32F, CUDA_C_32F);
+}
+
+template <>
+FFT2DR2C<CUDA_R_32F>::FFT2DR2C(const int nx, const int ny, const int batch)
+    : FFT2DR2C(nx, ny, batch, ny, ny / 2 + 1) {}
+
+template <>
+FFT2DR2C<CUDA_R_32F>::FFT2DR2C(const int nx, const int ny)
+    : FFT2DR2C(nx, ny, 1) {}
+
+template <>
+FFT2DR2C<CUDA_R_16F>::FFT2DR2C(const int nx, const int ny, const int batch,
+                               long long inembed, long long ouembed)
+    : FFT(checkPadding(ny, inembed, ouembed)) {
+  makePlan(nx, ny, batch, inembed, ouembed, CUDA_R_16F, CUDA_C_16F);
+}
+
+template <>
+FFT2DR2C<CUDA_R_16F>::FFT2DR2C(const int nx, const int ny, const int batch)
+    : FFT2DR2C(nx, ny, batch, ny, ny / 2 + 1) {}
+
+template <>
+FFT2DR2C<CUDA_R_16F>::FFT2DR2C(const int nx, const int ny)
+    : FFT2DR2C(nx, ny, 1) {}
+
+/*
+ * FFT2DC2R
+ *
+ * The inverse of FFT2DR2C: the input has nx rows of ny / 2 + 1 complex
+ * elements, the real output has nx rows of ny elements. The layout of padded
+ * rows follows FFT2DR2C, with inembed and ouembed swapped.
+ */
+template <cudaDataType_t T>
+class FFT2DC2R : public FFT {
+ public:
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DC2R(cu::Stream &stream, const int nx, const int ny) : FFT2DC2R(nx, ny) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DC2R(cu::Stream &stream, const int nx, const int ny, const int batch)
+      : FFT2DC2R(nx, ny, batch) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DC2R(cu::Stream &stream, const int nx, const int ny, const int batch,
+           long long inembed, long long ouembed)
+      : FFT2DC2R(nx, ny, batch, inembed, ouembed) {
+    setStream(stream);
+  }
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DC2R(const int nx, const int ny) = delete;
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DC2R(const int nx, const int ny, const int batch) = delete;
+#if defined(__HIP__)
+  __host__
+#endif
+  FFT2DC2R(const int nx, const int ny, const int batch, long long inembed,
+           long long ouembed) = delete;
+
+ private:
+  static cufftResult checkPadding(const int ny, long long inembed,
+                                  long long ouembed) {
+    if (inembed < ny / 2 + 1 || ouembed < ny) {
+      return CUFFT_INVALID_SIZE;
+    }
+    return CUFFT_SUCCESS;
+  }
+
+  void makePlan(const int nx, const int ny, const int batch, long long inembed,
+                long long ouembed, cudaDataType_t inputType,
+                cudaDataType_t outputType) {
+    checkCuFFTCall(cufftCreate(plan()));
+    const int rank = 2;
+    size_t ws = 0;
+    std::array<long long, 2> n{nx, ny};
+    std::array<long long, 2> inembed_{nx, inembed};
+    std::array<long long, 2> ouembed_{nx, ouembed};
+    const long long idist = nx * inembed;
+    const long long odist = nx * ouembed;
+    const long long istride = 1;
+    const long long ostride = 1;
+
+    checkCuFFTCall(cufftXtMakePlanMany(
+        *plan(), rank, n.data(), inembed_.data(), istride, idist, inputType,
+        ouembed_.data(), ostride, odist, outputType, batch, &ws, inputType));
+  }
+};
+
+template <>
+FFT2DC2R<CUDA_C_32F>::FFT2DC2R(const int nx, const int ny, const int batch,
+                               long long inembed, long long ouembed)
+    : FFT(checkPadding(ny, inembed, ouembed)) {
+  makePlan(nx, ny, batch, inembed, ouembed, CUDA_C_32F, CUDA_R_32F);
+}
+
+template <>
+FFT2DC2R<CUDA_C_32F>::FFT2DC2R(const int nx, const int ny, const int batch)
+    : FFT2DC2R(nx, ny, batch, ny / 2 + 1, ny) {}
+
+template <>
+FFT2DC2R<CUDA_C_32F>::FFT2DC2R(const int nx, const int ny)
+    : FFT2DC2R(nx, ny, 1) {}
+
+template <>
+FFT2DC2R<CUDA_C_16F>::FFT2DC2R(const int nx, const int ny, const int batch,
+                               long long inembed, long long ouembed)
+    : FFT(checkPadding(ny, inembed, ouembed)) {
+  makePlan(nx, ny, batch, inembed, ouembed, CUDA_C_16F, CUDA_R_16F);
+}
+
+template <>
+FFT2DC2R<CUDA_C_16F>::FFT2DC2R(const int nx, const int ny, const int batch)
+    : FFT2DC2R(nx, ny, batch, ny / 2 + 1, ny) {}
+
+template <>
+FFT2DC2R<CUDA_C_16F>::FFT2DC2R(const int nx, const int ny)
+    : FFT2DC2R(nx, ny, 1) {}
+
 }  // namespace cufft
 
 #endif  // CUFFT_H
\ No newline at end of file
@@ -127,6 +127,14 @@ typedef uint32_t cuuint32_t;
 #define CUFFT_UNALIGNED_DATA HIPFFT_UNALIGNED_DATA
 #define CUFFT_Z2D HIPFFT_Z2D
 #define CUFFT_Z2Z HIPFFT_Z2Z
+#define CU_AD_FORMAT_FLOAT HIP_AD_FORMAT_FLOAT
+#define CU_AD_FORMAT_HALF HIP_AD_FORMAT_HALF
+#define CU_AD_FORMAT_SIGNED_INT16 HIP_AD_FORMAT_SIGNED_INT16
+#define CU_AD_FORMAT_SIGNED_INT32 HIP_AD_FORMAT_SIGNED_INT32
+#define CU_AD_FORMAT_SIGNED_INT8 HIP_AD_FORMAT_SIGNED_INT8
+#define CU_AD_FORMAT_UNSIGNED_INT16 HIP_AD_FORMAT_UNSIGNED_INT16
+#define CU_AD_FORMAT_UNSIGNED_INT32 HIP_AD_FORMAT_UNSIGNED_INT32
+#define CU_AD_FORMAT_UNSIGNED_INT8 HIP_AD_FORMAT_UNSIGNED_INT8
 #define CU_ARRAY_SPARSE_SUBRESOURCE_TYPE_MIPTAIL   hipArraySparseSubresourceTypeMiptail
 #define CU_ARRAY_SPARSE_SUBRESOURCE_TYPE_SPARSE_LEVEL   hipArraySparseSubresourceTypeSparseLevel
 #define CU_COMPUTEMODE_DEFAULT hipComputeModeDefault
@@ -580,6 +588,7 @@ typedef uint32_t cuuint32_t;
 #define cuLinkComplete hiprtcLinkComplete
 #define cuLinkCreate hiprtcLinkCreate
 #define cuLinkDestroy hiprtcLinkDestroy
+#define cuMemAdvise hipMemAdvise
 #define cuMemAlloc hipMalloc
 #define cuMemAlloc hipMalloc
 #define cuMemAllocAsync hipMallocAsync
@@ -609,6 +618,8 @@ typedef uint32_t cuuint32_t;
 #define cuMemHostUnregister hipHostUnregister
 #define cuMemHostUnregister hipHostUnregister
 #define cuMemPrefetchAsync hipMemPrefetchAsync
+#define cuMemRangeGetAttribute hipMemRangeGetAttribute
+#define cuMemRangeGetAttributes hipMemRangeGetAttributes
 #define cuMemcpy2D hipMemcpyParam2D
 #define cuMemcpy2D hipMemcpyParam2D
 #define cuMemcpy2DAsync hipMemcpyParam2DAsync
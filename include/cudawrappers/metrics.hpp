@@ -0,0 +1,365 @@
+#if !defined METRICS_H
+#define METRICS_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cudawrappers/cu.hpp>
+#if !defined(__HIP_PLATFORM_AMD__)
+#include <cudawrappers/nvml.hpp>
+#endif
+
+namespace metrics {
+
+/*
+ * Exporter
+ *
+ * Publishes the cu::Counters of this process and, where NVML is available,
+ * the telemetry of every device in the Prometheus text format. The metrics
+ * are either served over HTTP on a local port, or written to a file for the
+ * textfile collector of the node exporter. Sampling the counters does not
+ * take any lock on the code paths that submit work.
+ */
+class Exporter {
+ public:
+  explicit Exporter(bool telemetry = true) {
+#if !defined(__HIP_PLATFORM_AMD__)
+    if (telemetry) {
+      const nvml::Context context;
+      const unsigned int count = nvml::Device::getCount();
+      for (unsigned int index = 0; index < count; index++) {
+        telemetry_.emplace_back(nvml::Device(static_cast<int>(index)));
+      }
+    }
+#endif
+  }
+
+  Exporter(const Exporter&) = delete;
+  Exporter& operator=(const Exporter&) = delete;
+
+  ~Exporter() {
+    running_.store(false, std::memory_order_relaxed);
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+    for (int socket : sockets_) {
+      close(socket);
+    }
+  }
+
+  // The metrics in the Prometheus text exposition format
+  std::string collect() const {
+    std::ostringstream out;
+    const cu::Counters& counters = cu::getCounters();
+
+    write(out, "cudawrappers_device_allocations_total", "counter",
+          "Device memory allocations", counters.deviceAllocations);
+    write(out, "cudawrappers_device_memory_bytes", "gauge",
+          "Device memory currently allocated", counters.deviceBytes);
+    write(out, "cudawrappers_host_allocations_total", "counter",
+          "Pinned host memory allocations and registrations",
+          counters.hostAllocations);
+    write(out, "cudawrappers_host_memory_bytes", "gauge",
+          "Pinned host memory currently allocated or registered",
+          counters.hostBytes);
+    header(out, "cudawrappers_copied_bytes_total", "counter",
+           "Bytes copied, by direction");
+    sample(out, "cudawrappers_copied_bytes_total", "direction=\"htod\"",
+           counters.bytesCopiedHtoD);
+    sample(out, "cudawrappers_copied_bytes_total", "direction=\"dtoh\"",
+           counters.bytesCopiedDtoH);
+    sample(out, "cudawrappers_copied_bytes_total", "direction=\"dtod\"",
+           counters.bytesCopiedDtoD);
+    sample(out, "cudawrappers_copied_bytes_total", "direction=\"htoh\"",
+           counters.bytesCopiedHtoH);
+    write(out, "cudawrappers_kernel_launches_total", "counter",
+          "Kernel launches", counters.kernelLaunches);
+    write(out, "cudawrappers_synchronizations_total", "counter",
+          "Host synchronizations with streams, events and contexts",
+          counters.synchronizations);
+    write(out, "cudawrappers_synchronize_seconds_total", "counter",
+          "Time spent waiting in host synchronizations",
+          counters.synchronizeNanoseconds * 1e-9);
+    write(out, "cudawrappers_pool_hits_total", "counter",
+          "Allocations served from a cache", counters.poolHits);
+    write(out, "cudawrappers_pool_misses_total", "counter",
+          "Allocations of cacheable size passed to the driver",
+          counters.poolMisses);
+    write(out, "cudawrappers_deferred_releases_total", "counter",
+          "Frees queued by the release policy", counters.deferredReleases);
+    write(out, "cudawrappers_deferred_bytes", "gauge",
+          "Bytes held by queued frees", counters.deferredBytes);
+    write(out, "cudawrappers_hazard_waits_total", "counter",
+          "Stream waits inserted by hazard tracking", counters.hazardWaits);
+
+#if !defined(__HIP_PLATFORM_AMD__)
+    std::vector<nvml::Telemetry::Snapshot> snapshots;
+    for (const nvml::Telemetry& telemetry : telemetry_) {
+      snapshots.push_back(telemetry.collect());
+    }
+    writeTelemetry(out, snapshots);
+#endif
+
+    return out.str();
+  }
+
+  // Write the metrics to a temporary file first and rename it, such that a
+  // reader never sees a partially written file
+  void writeTextfile(const std::string& path) const {
+    const std::string temporary = path + ".tmp";
+    {
+      std::ofstream file(temporary);
+      file << collect();
+      if (!file) {
+        throw std::runtime_error("Could not write " + temporary);
+      }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+      throw std::runtime_error("Could not rename " + temporary);
+    }
+  }
+
+  // Periodically call writeTextfile() on a background thread
+  void writeTextfile(const std::string& path,
+                     std::chrono::milliseconds interval) {
+    writeTextfile(path);
+    threads_.emplace_back([this, path, interval] {
+      auto next = std::chrono::steady_clock::now();
+      while (running_.load(std::memory_order_relaxed)) {
+        next += interval;
+        while (running_.load(std::memory_order_relaxed) &&
+               std::chrono::steady_clock::now() < next) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        try {
+          writeTextfile(path);
+        } catch (std::runtime_error&) {
+          // Try again at the next interval
+        }
+      }
+    });
+  }
+
+  // Serve the metrics over HTTP on the loopback interface, on a background
+  // thread. Every request is answered with the metrics, regardless of path.
+  void listen(unsigned short port) {
+    const int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0) {
+      throw std::runtime_error("Could not create socket");
+    }
+    sockets_.push_back(server);
+    const int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(server, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) != 0 ||
+        ::listen(server, 16) != 0) {
+      throw std::runtime_error("Could not listen on port " +
+                               std::to_string(port));
+    }
+
+    threads_.emplace_back([this, server] {
+      while (running_.load(std::memory_order_relaxed)) {
+        pollfd descriptor{server, POLLIN, 0};
+        if (poll(&descriptor, 1, 100) <= 0) {
+          continue;
+        }
+        const int client = accept(server, nullptr, nullptr);
+        if (client >= 0) {
+          respond(client);
+          close(client);
+        }
+      }
+    });
+  }
+
+ private:
+  void respond(int client) const {
+    // A client that stalls must not block the server thread, and with it
+    // the destructor, for long
+    timeval timeout{};
+    timeout.tv_sec = 1;
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) != 0 ||
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout)) != 0) {
+      return;
+    }
+
+    // The request itself is not inspected, read it to not reset the
+    // connection before the response is sent
+    char request[1024];
+    if (recv(client, request, sizeof(request), 0) <= 0) {
+      return;  // closed, timed out or failed
+    }
+
+    const std::string body = collect();
+    std::ostringstream response;
+    response << "HTTP/1.0 200 OK\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.size() << "\r\n\r\n"
+             << body;
+    const std::string data = response.str();
+    size_t offset = 0;
+    while (offset < data.size()) {
+      const ssize_t sent = send(client, data.data() + offset,
+                                data.size() - offset, MSG_NOSIGNAL);
+      if (sent <= 0) {
+        break;  // closed, timed out or failed
+      }
+      offset += static_cast<size_t>(sent);
+    }
+  }
+
+  static void header(std::ostream& out, const char* name, const char* type,
+                     const char* help) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+  }
+
+  template <typename T>
+  static void sample(std::ostream& out, const char* name,
+                     const std::string& labels, const T& value) {
+    out << name;
+    if (!labels.empty()) {
+      out << "{" << labels << "}";
+    }
+    out << " " << value << "\n";
+  }
+
+  static void write(std::ostream& out, const char* name, const char* type,
+                    const char* help, uint64_t value) {
+    header(out, name, type, help);
+    sample(out, name, "", value);
+  }
+
+  static void write(std::ostream& out, const char* name, const char* type,
+                    const char* help, double value) {
+    header(out, name, type, help);
+    sample(out, name, "", value);
+  }
+
+#if !defined(__HIP_PLATFORM_AMD__)
+  static void writeTelemetry(
+      std::ostream& out,
+      const std::vector<nvml::Telemetry::Snapshot>& snapshots) {
+    struct Metric {
+      const char* name;
+      const char* type;
+      const char* help;
+      nvml::Telemetry::Metric metric;
+      std::vector<std::pair<std::string, double>> (*values)(
+          const nvml::Telemetry::Snapshot&);
+    };
+
+    static const Metric metrics[] = {
+        {"gpu_clock_mhz", "gauge", "Current clock frequency",
+         nvml::Telemetry::clocks,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"clock=\"graphics\"", s.graphicsClock},
+               {"clock=\"sm\"", s.smClock},
+               {"clock=\"memory\"", s.memoryClock}};
+         }},
+        {"gpu_power_watts", "gauge", "Power usage", nvml::Telemetry::power,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"", s.power * 1e-3}};
+         }},
+        {"gpu_energy_joules_total", "counter",
+         "Energy consumed since the driver was loaded",
+         nvml::Telemetry::energy,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"", s.energy * 1e-3}};
+         }},
+        {"gpu_temperature_celsius", "gauge", "GPU temperature",
+         nvml::Telemetry::temperature,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"", s.temperature}};
+         }},
+        {"gpu_utilization_ratio", "gauge",
+         "Fraction of time the GPU or its memory was busy",
+         nvml::Telemetry::utilization,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"unit=\"gpu\"", s.gpuUtilization * 1e-2},
+               {"unit=\"memory\"", s.memoryUtilization * 1e-2}};
+         }},
+        {"gpu_memory_used_bytes", "gauge", "Device memory in use",
+         nvml::Telemetry::memory,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"", static_cast<double>(s.memoryUsed)}};
+         }},
+        {"gpu_memory_total_bytes", "gauge", "Device memory",
+         nvml::Telemetry::memory,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"", static_cast<double>(s.memoryTotal)}};
+         }},
+        {"gpu_throttle_reasons", "gauge",
+         "Bitmask of the reasons the clocks are reduced",
+         nvml::Telemetry::throttleReasons,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"", static_cast<double>(s.throttleReasons)}};
+         }},
+        {"gpu_pcie_bytes_per_second", "gauge", "PCIe throughput",
+         nvml::Telemetry::pcie,
+         [](const nvml::Telemetry::Snapshot& s) {
+           return std::vector<std::pair<std::string, double>>{
+               {"direction=\"tx\"", s.pcieTx * 1e3},
+               {"direction=\"rx\"", s.pcieRx * 1e3}};
+         }},
+    };
+
+    for (const Metric& metric : metrics) {
+      bool first = true;
+      for (size_t device = 0; device < snapshots.size(); device++) {
+        if (!snapshots[device].has(metric.metric)) {
+          continue;
+        }
+        if (first) {
+          header(out, metric.name, metric.type, metric.help);
+          first = false;
+        }
+        const std::string label = "device=\"" + std::to_string(device) + "\"";
+        for (const auto& value : metric.values(snapshots[device])) {
+          sample(out, metric.name,
+                 value.first.empty() ? label : label + "," + value.first,
+                 value.second);
+        }
+      }
+    }
+  }
+
+  std::vector<nvml::Telemetry> telemetry_;
+#endif
+  std::atomic<bool> running_{true};
+  std::vector<std::thread> threads_;
+  std::vector<int> sockets_;
+};
+
+}  // namespace metrics
+
+#endif  // METRICS_H
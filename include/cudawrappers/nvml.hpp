@@ -5,7 +5,19 @@
 
 #include <nvml.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <cudawrappers/cu.hpp>
 
@@ -26,13 +38,95 @@ inline void checkNvmlCall(nvmlReturn_t result) {
   if (result != NVML_SUCCESS) throw Error(result);
 }
 
+// NVML is initialized when the first Context is created and shut down when
+// the last one is destroyed, so holding a Context in a long-lived object
+// keeps NVML initialized for the lifetime of that object.
 class Context {
  public:
-  Context() { checkNvmlCall(nvmlInit()); }
+  Context() {
+    std::lock_guard<std::mutex> lock(mutex());
+    if (count() == 0) {
+      checkNvmlCall(nvmlInit());
+    }
+    count()++;
+  }
+
+  Context(const Context&) : Context() {}
+
+  Context& operator=(const Context&) = default;
+
+  ~Context() {
+    std::lock_guard<std::mutex> lock(mutex());
+    if (--count() == 0) {
+      checkNvmlCall(nvmlShutdown());
+    }
+  }
+
+  static size_t getReferenceCount() {
+    std::lock_guard<std::mutex> lock(mutex());
+    return count();
+  }
 
-  ~Context() { checkNvmlCall(nvmlShutdown()); }
+ private:
+  static std::mutex& mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static size_t& count() {
+    static size_t count = 0;
+    return count;
+  }
 };
 
+// Clock frequencies in MHz, zero if the device does not report them
+struct ClockState {
+  unsigned int graphics;
+  unsigned int sm;
+  unsigned int memory;
+  unsigned int applicationsGraphics;
+  unsigned int applicationsMemory;
+};
+
+// A range of locked clocks in MHz, see Device::getLockedGpuClocks()
+struct LockedClocks {
+  bool locked;
+  unsigned int minClockMhz;
+  unsigned int maxClockMhz;
+};
+
+namespace detail {
+// NVML cannot query locked clocks, so the locks that are set through the
+// wrappers are remembered per device and clock (graphics or memory)
+class LockedClocksRegistry {
+ public:
+  LockedClocks get(nvmlDevice_t device, nvmlClockType_t clock) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = clocks_.find(std::make_pair(device, clock));
+    return entry != clocks_.end() ? entry->second : LockedClocks{};
+  }
+
+  void set(nvmlDevice_t device, nvmlClockType_t clock,
+           const LockedClocks& clocks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (clocks.locked) {
+      clocks_[std::make_pair(device, clock)] = clocks;
+    } else {
+      clocks_.erase(std::make_pair(device, clock));
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<std::pair<nvmlDevice_t, nvmlClockType_t>, LockedClocks> clocks_;
+};
+
+inline LockedClocksRegistry& getLockedClocksRegistry() {
+  static LockedClocksRegistry registry;
+  return registry;
+}
+}  // namespace detail
+
 class Device {
  public:
   Device(int index) {
@@ -44,6 +138,12 @@ class Device {
     checkNvmlCall(nvmlDeviceGetHandleByUUID(uuid.c_str(), &device_));
   }
 
+  static unsigned int getCount() {
+    unsigned int count;
+    checkNvmlCall(nvmlDeviceGetCount(&count));
+    return count;
+  }
+
   void getFieldValues(int valuesCount, nvmlFieldValue_t* values) const {
     checkNvmlCall(nvmlDeviceGetFieldValues(device_, valuesCount, values));
   }
@@ -61,9 +161,1057 @@ class Device {
     return power;
   }
 
+  // Power limit in milliwatts
+  unsigned int getPowerManagementLimit() const {
+    unsigned int limit;
+    checkNvmlCall(nvmlDeviceGetPowerManagementLimit(device_, &limit));
+    return limit;
+  }
+
+  nvmlUtilization_t getUtilizationRates() const {
+    nvmlUtilization_t utilization;
+    checkNvmlCall(nvmlDeviceGetUtilizationRates(device_, &utilization));
+    return utilization;
+  }
+
+  nvmlMemory_t getMemoryInfo() const {
+    nvmlMemory_t memory;
+    checkNvmlCall(nvmlDeviceGetMemoryInfo(device_, &memory));
+    return memory;
+  }
+
+  unsigned int getComputeRunningProcessCount() const {
+    unsigned int count = 0;
+    const nvmlReturn_t result =
+        nvmlDeviceGetComputeRunningProcesses(device_, &count, nullptr);
+    if (result != NVML_ERROR_INSUFFICIENT_SIZE) {
+      checkNvmlCall(result);
+    }
+    return count;
+  }
+
+  // Energy consumed since the driver was last reloaded, in millijoules
+  unsigned long long getTotalEnergyConsumption() const {
+    unsigned long long energy;
+    checkNvmlCall(nvmlDeviceGetTotalEnergyConsumption(device_, &energy));
+    return energy;
+  }
+
+  unsigned int getApplicationsClock(nvmlClockType_t clockType) const {
+    unsigned int clockMhz;
+    checkNvmlCall(
+        nvmlDeviceGetApplicationsClock(device_, clockType, &clockMhz));
+    return clockMhz;
+  }
+
+  unsigned int getDefaultApplicationsClock(nvmlClockType_t clockType) const {
+    unsigned int clockMhz;
+    checkNvmlCall(
+        nvmlDeviceGetDefaultApplicationsClock(device_, clockType, &clockMhz));
+    return clockMhz;
+  }
+
+  ClockState getClockState() const {
+    ClockState state{};
+    nvmlDeviceGetClockInfo(device_, NVML_CLOCK_GRAPHICS, &state.graphics);
+    nvmlDeviceGetClockInfo(device_, NVML_CLOCK_SM, &state.sm);
+    nvmlDeviceGetClockInfo(device_, NVML_CLOCK_MEM, &state.memory);
+    nvmlDeviceGetApplicationsClock(device_, NVML_CLOCK_GRAPHICS,
+                                   &state.applicationsGraphics);
+    nvmlDeviceGetApplicationsClock(device_, NVML_CLOCK_MEM,
+                                   &state.applicationsMemory);
+    return state;
+  }
+
+  // Changing clocks typically requires root privileges
+  void lockGpuClocks(unsigned int minClockMhz, unsigned int maxClockMhz) {
+    checkNvmlCall(nvmlDeviceLockGpuClocks(device_, minClockMhz, maxClockMhz));
+    detail::getLockedClocksRegistry().set(
+        device_, NVML_CLOCK_GRAPHICS, {true, minClockMhz, maxClockMhz});
+  }
+
+  void resetGpuLockedClocks() {
+    checkNvmlCall(nvmlDeviceResetGpuLockedClocks(device_));
+    detail::getLockedClocksRegistry().set(device_, NVML_CLOCK_GRAPHICS, {});
+  }
+
+  void lockMemoryClocks(unsigned int minClockMhz, unsigned int maxClockMhz) {
+    checkNvmlCall(
+        nvmlDeviceLockMemoryClocks(device_, minClockMhz, maxClockMhz));
+    detail::getLockedClocksRegistry().set(device_, NVML_CLOCK_MEM,
+                                          {true, minClockMhz, maxClockMhz});
+  }
+
+  void resetMemoryLockedClocks() {
+    checkNvmlCall(nvmlDeviceResetMemoryLockedClocks(device_));
+    detail::getLockedClocksRegistry().set(device_, NVML_CLOCK_MEM, {});
+  }
+
+  // The clocks that were locked through these wrappers in this process, NVML
+  // does not report locks set by others (e.g. nvidia-smi)
+  LockedClocks getLockedGpuClocks() const {
+    return detail::getLockedClocksRegistry().get(device_, NVML_CLOCK_GRAPHICS);
+  }
+
+  LockedClocks getLockedMemoryClocks() const {
+    return detail::getLockedClocksRegistry().get(device_, NVML_CLOCK_MEM);
+  }
+
+  void setApplicationsClocks(unsigned int memoryClockMhz,
+                             unsigned int graphicsClockMhz) {
+    checkNvmlCall(nvmlDeviceSetApplicationsClocks(device_, memoryClockMhz,
+                                                  graphicsClockMhz));
+  }
+
+  void resetApplicationsClocks() {
+    checkNvmlCall(nvmlDeviceResetApplicationsClocks(device_));
+  }
+
+  // PCIe throughput over the last 20 ms in KB/s, TX is from the device
+  unsigned int getPcieThroughput(nvmlPcieUtilCounter_t counter) const {
+    unsigned int throughput;
+    checkNvmlCall(nvmlDeviceGetPcieThroughput(device_, counter, &throughput));
+    return throughput;
+  }
+
+  unsigned int getPcieReplayCounter() const {
+    unsigned int count;
+    checkNvmlCall(nvmlDeviceGetPcieReplayCounter(device_, &count));
+    return count;
+  }
+
+  unsigned int getPcieLinkGeneration() const {
+    unsigned int generation;
+    checkNvmlCall(nvmlDeviceGetCurrPcieLinkGeneration(device_, &generation));
+    return generation;
+  }
+
+  unsigned int getPcieLinkWidth() const {
+    unsigned int width;
+    checkNvmlCall(nvmlDeviceGetCurrPcieLinkWidth(device_, &width));
+    return width;
+  }
+
+  // Theoretical PCIe bandwidth per direction of the current link in bytes/s,
+  // after line encoding but before protocol overhead
+  double getPcieBandwidth() const {
+    const double laneBandwidth[] = {250e6, 500e6, 985e6, 1969e6, 3938e6,
+                                    7877e6};
+    const unsigned int generation = std::min<unsigned int>(
+        std::max<unsigned int>(getPcieLinkGeneration(), 1), 6);
+    return laneBandwidth[generation - 1] * getPcieLinkWidth();
+  }
+
+  bool isNvLinkActive(unsigned int link) const {
+    nvmlEnableState_t state;
+    return nvmlDeviceGetNvLinkState(device_, link, &state) == NVML_SUCCESS &&
+           state == NVML_FEATURE_ENABLED;
+  }
+
+  unsigned int getNvLinkCount() const {
+    unsigned int count = 0;
+    for (unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+      count += isNvLinkActive(link);
+    }
+    return count;
+  }
+
+  // Data transmitted (TX) and received (RX) over all active NVLinks since
+  // the driver was loaded, in KiB
+  void getNvLinkThroughput(unsigned long long& tx,
+                           unsigned long long& rx) const {
+    tx = rx = 0;
+#if defined(NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX)
+    std::vector<nvmlFieldValue_t> values;
+    for (unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+      if (isNvLinkActive(link)) {
+        nvmlFieldValue_t value{};
+        value.scopeId = link;
+        value.fieldId = NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX;
+        values.push_back(value);
+        value.fieldId = NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX;
+        values.push_back(value);
+      }
+    }
+    if (values.empty()) {
+      return;
+    }
+    getFieldValues(static_cast<int>(values.size()), values.data());
+    for (const nvmlFieldValue_t& value : values) {
+      checkNvmlCall(value.nvmlReturn);
+      (value.fieldId == NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX ? tx : rx) +=
+          value.value.ullVal;
+    }
+#else
+    if (getNvLinkCount() > 0) {
+      checkNvmlCall(NVML_ERROR_NOT_SUPPORTED);
+    }
+#endif
+  }
+
+  // Number of data link replays over all active NVLinks
+  unsigned long long getNvLinkReplayCounter() const {
+    unsigned long long total = 0;
+    for (unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+      if (isNvLinkActive(link)) {
+        unsigned long long count;
+        checkNvmlCall(nvmlDeviceGetNvLinkErrorCounter(
+            device_, link, NVML_NVLINK_ERROR_DL_REPLAY, &count));
+        total += count;
+      }
+    }
+    return total;
+  }
+
+  operator nvmlDevice_t() const { return device_; }
+
  private:
   nvmlDevice_t device_;
 };
+
+/*
+ * ClockLock
+ *
+ * Fixes the clocks of a device for as long as the ClockLock exists. On
+ * destruction, the clocks are restored to the state they had before: locked
+ * GPU and memory clocks are locked to the previous range if there was one
+ * (see Device::getLockedGpuClocks()) and reset otherwise, application clocks
+ * are set to their previous values.
+ */
+class ClockLock {
+ public:
+  ClockLock(const ClockLock&) = delete;
+  ClockLock& operator=(const ClockLock&) = delete;
+
+  ClockLock(ClockLock&& other) noexcept
+      : device_(other.device_),
+        type_(other.type_),
+        previous_(other.previous_),
+        previousLock_(other.previousLock_) {
+    other.type_ = none;
+  }
+
+  ~ClockLock() {
+    // Restoring clocks is best effort: a destructor should not throw
+    switch (type_) {
+      case gpu:
+        restore(NVML_CLOCK_GRAPHICS, nvmlDeviceLockGpuClocks,
+                nvmlDeviceResetGpuLockedClocks);
+        break;
+      case memory:
+        restore(NVML_CLOCK_MEM, nvmlDeviceLockMemoryClocks,
+                nvmlDeviceResetMemoryLockedClocks);
+        break;
+      case applications:
+        nvmlDeviceSetApplicationsClocks(device_,
+                                        previous_.applicationsMemory,
+                                        previous_.applicationsGraphics);
+        break;
+      default:
+        break;
+    }
+  }
+
+  static ClockLock lockGpuClocks(Device& device, unsigned int minClockMhz,
+                                 unsigned int maxClockMhz) {
+    ClockLock lock(device);
+    lock.previousLock_ = device.getLockedGpuClocks();
+    device.lockGpuClocks(minClockMhz, maxClockMhz);
+    lock.type_ = gpu;
+    return lock;
+  }
+
+  static ClockLock lockMemoryClocks(Device& device, unsigned int minClockMhz,
+                                    unsigned int maxClockMhz) {
+    ClockLock lock(device);
+    lock.previousLock_ = device.getLockedMemoryClocks();
+    device.lockMemoryClocks(minClockMhz, maxClockMhz);
+    lock.type_ = memory;
+    return lock;
+  }
+
+  static ClockLock setApplicationsClocks(Device& device,
+                                         unsigned int memoryClockMhz,
+                                         unsigned int graphicsClockMhz) {
+    ClockLock lock(device);
+    device.setApplicationsClocks(memoryClockMhz, graphicsClockMhz);
+    lock.type_ = applications;
+    return lock;
+  }
+
+  // Lock the GPU clock to the default application clock, which the device
+  // can sustain without boosting, for reproducible measurements
+  static ClockLock lockBaseClocks(Device& device) {
+    const unsigned int clockMhz =
+        device.getDefaultApplicationsClock(NVML_CLOCK_GRAPHICS);
+    return lockGpuClocks(device, clockMhz, clockMhz);
+  }
+
+  // The clocks before the lock was taken
+  const ClockState& getPreviousState() const { return previous_; }
+
+  // The locked GPU or memory clocks before the lock was taken
+  const LockedClocks& getPreviousLock() const { return previousLock_; }
+
+ private:
+  enum Type { none, gpu, memory, applications };
+
+  void restore(nvmlClockType_t clock,
+               nvmlReturn_t (*lock)(nvmlDevice_t, unsigned int, unsigned int),
+               nvmlReturn_t (*reset)(nvmlDevice_t)) {
+    const nvmlReturn_t result =
+        previousLock_.locked ? lock(device_, previousLock_.minClockMhz,
+                                    previousLock_.maxClockMhz)
+                             : reset(device_);
+    if (result == NVML_SUCCESS) {
+      detail::getLockedClocksRegistry().set(device_, clock, previousLock_);
+    }
+  }
+
+  // type_ is only set after the clocks were changed successfully, such that
+  // nothing is reset when changing the clocks throws
+  explicit ClockLock(Device& device)
+      : device_(device), type_(none), previous_(device.getClockState()) {}
+
+  Device device_;
+  Type type_;
+  ClockState previous_;
+  LockedClocks previousLock_{};
+};
+
+/*
+ * PowerSampler
+ *
+ * Samples the power usage (and the energy counter, on devices that have one)
+ * of a device on a background thread. The samples are kept in a lock-free
+ * ring buffer, which is read when a region ends to attribute energy to the
+ * region. Regions may be nested, begin() and end() should be called from a
+ * single thread.
+ */
+class PowerSampler {
+ public:
+  struct Sample {
+    double time;                // seconds since the sampler was started
+    unsigned int power;         // milliwatts
+    unsigned long long energy;  // millijoules, zero if not supported
+  };
+
+  struct Region {
+    std::string name;
+    double seconds;
+    double joules;
+    double watts;  // average power
+    size_t samples;
+  };
+
+  explicit PowerSampler(
+      const Device& device,
+      std::chrono::microseconds interval = std::chrono::milliseconds(10),
+      size_t capacity = 4096)
+      : device_(device),
+        interval_(interval),
+        capacity_(capacity),
+        ring_(new Slot[capacity]),
+        start_(std::chrono::steady_clock::now()) {
+    unsigned long long energy;
+    hasEnergy_ = nvmlDeviceGetTotalEnergyConsumption(device_, &energy) ==
+                 NVML_SUCCESS;
+    takeSample();
+    thread_ = std::thread([this] { run(); });
+  }
+
+  PowerSampler(const PowerSampler&) = delete;
+  PowerSampler& operator=(const PowerSampler&) = delete;
+
+  ~PowerSampler() {
+    running_.store(false, std::memory_order_relaxed);
+    thread_.join();
+  }
+
+  bool hasEnergyCounter() const { return hasEnergy_; }
+
+  // Most recent sample
+  Sample read() const {
+    Sample sample{};
+    size_t index = head_.load(std::memory_order_acquire);
+    while (index > 0 && !read(index, sample)) {
+      index = head_.load(std::memory_order_acquire);
+    }
+    return sample;
+  }
+
+  void begin(const std::string& name) {
+    OpenRegion region;
+    region.name = name;
+    region.head = head_.load(std::memory_order_acquire);
+    region.energy = hasEnergy_ ? device_.getTotalEnergyConsumption() : 0;
+    region.time = now();
+    open_.push_back(region);
+  }
+
+  Region end() {
+    if (open_.empty()) {
+      throw std::logic_error("PowerSampler::end() without begin()");
+    }
+    const double time = now();
+    const OpenRegion open = open_.back();
+    open_.pop_back();
+
+    Region region{open.name, time - open.time, 0, 0, 0};
+
+    // Average the power of the samples taken within the region, or use the
+    // sample taken just before the region if it was shorter than the interval
+    double power = 0;
+    const size_t head = head_.load(std::memory_order_acquire);
+    const size_t first =
+        head - open.head < capacity_ ? open.head + 1 : head - capacity_ + 1;
+    for (size_t index = first; index <= head; index++) {
+      Sample sample;
+      if (read(index, sample) && sample.time >= open.time &&
+          sample.time <= time) {
+        power += sample.power;
+        region.samples++;
+      }
+    }
+    if (region.samples > 0) {
+      power /= region.samples;
+    } else {
+      Sample sample;
+      power = read(open.head, sample) ? sample.power : read().power;
+    }
+
+    // The energy counter is updated less often than it is read, so it does
+    // not advance over a short region: then use the power samples instead
+    const unsigned long long energy =
+        hasEnergy_ ? device_.getTotalEnergyConsumption() : 0;
+    if (energy > open.energy && region.seconds > 0) {
+      region.joules = (energy - open.energy) * 1e-3;
+      region.watts = region.joules / region.seconds;
+    } else {
+      region.watts = power * 1e-3;
+      region.joules = region.watts * region.seconds;
+    }
+
+    regions_.push_back(region);
+    return region;
+  }
+
+  // All regions that have ended so far, in the order they ended
+  const std::vector<Region>& regions() const { return regions_; }
+
+ private:
+  // A ring buffer slot, guarded by a sequence lock: sequence holds the number
+  // of the sample in the slot, or zero while the slot is being written.
+  struct Slot {
+    std::atomic<size_t> sequence{0};
+    std::atomic<double> time{0};
+    std::atomic<unsigned int> power{0};
+    std::atomic<unsigned long long> energy{0};
+  };
+
+  struct OpenRegion {
+    std::string name;
+    size_t head;
+    unsigned long long energy;
+    double time;
+  };
+
+  double now() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+  bool read(size_t index, Sample& sample) const {
+    if (index == 0) {
+      return false;
+    }
+    const Slot& slot = ring_[index % capacity_];
+    if (slot.sequence.load(std::memory_order_acquire) != index) {
+      return false;
+    }
+    sample.time = slot.time.load(std::memory_order_relaxed);
+    sample.power = slot.power.load(std::memory_order_relaxed);
+    sample.energy = slot.energy.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == index;
+  }
+
+  void takeSample() {
+    unsigned int power;
+    unsigned long long energy = 0;
+    if (nvmlDeviceGetPowerUsage(device_, &power) != NVML_SUCCESS ||
+        (hasEnergy_ && nvmlDeviceGetTotalEnergyConsumption(
+                           device_, &energy) != NVML_SUCCESS)) {
+      return;
+    }
+    const size_t index = head_.load(std::memory_order_relaxed) + 1;
+    Slot& slot = ring_[index % capacity_];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time.store(now(), std::memory_order_relaxed);
+    slot.power.store(power, std::memory_order_relaxed);
+    slot.energy.store(energy, std::memory_order_relaxed);
+    slot.sequence.store(index, std::memory_order_release);
+    head_.store(index, std::memory_order_release);
+  }
+
+  void run() {
+    auto next = std::chrono::steady_clock::now();
+    while (running_.load(std::memory_order_relaxed)) {
+      next += interval_;
+      std::this_thread::sleep_until(next);
+      takeSample();
+    }
+  }
+
+  Context context_;
+  Device device_;
+  std::chrono::microseconds interval_;
+  size_t capacity_;
+  std::unique_ptr<Slot[]> ring_;
+  std::chrono::steady_clock::time_point start_;
+  bool hasEnergy_;
+  std::atomic<size_t> head_{0};
+  std::atomic<bool> running_{true};
+  std::thread thread_;
+  std::vector<OpenRegion> open_;
+  std::vector<Region> regions_;
+};
+
+/*
+ * Telemetry
+ *
+ * Collects a snapshot of the state of a device with as few NVML calls as
+ * possible: metrics that are available as field values are queried with a
+ * single nvmlDeviceGetFieldValues() call, the others with one call each.
+ * NVML only has field values for power and energy, which share one call. The
+ * clocks take three calls (graphics, SM and memory), the temperature,
+ * utilization, memory use and throttle reasons one call each, so a snapshot
+ * of the default metrics takes eight calls. The PCIe throughput, for which
+ * NVML only has byte counters, takes two more calls. Metrics that the device
+ * does not support are detected at construction and not queried again. Note
+ * that querying the PCIe throughput takes about 20 ms, it is therefore not
+ * collected by default.
+ */
+class Telemetry {
+ public:
+  enum Metric : unsigned {
+    clocks = 1 << 0,
+    power = 1 << 1,
+    energy = 1 << 2,
+    temperature = 1 << 3,
+    utilization = 1 << 4,
+    memory = 1 << 5,
+    throttleReasons = 1 << 6,
+    pcie = 1 << 7,
+    all = (1 << 8) - 1
+  };
+
+  struct Snapshot {
+    unsigned valid;                      // Metrics that were collected
+    unsigned int graphicsClock;          // MHz
+    unsigned int smClock;                // MHz
+    unsigned int memoryClock;            // MHz
+    unsigned int power;                  // milliwatts
+    unsigned long long energy;           // millijoules
+    unsigned int temperature;            // degrees Celsius
+    unsigned int gpuUtilization;         // percent
+    unsigned int memoryUtilization;      // percent
+    unsigned long long memoryUsed;       // bytes
+    unsigned long long memoryTotal;      // bytes
+    unsigned long long throttleReasons;  // nvmlClocksThrottleReason bits
+    unsigned int pcieTx;                 // KB/s
+    unsigned int pcieRx;                 // KB/s
+
+    bool has(Metric metric) const { return (valid & metric) == metric; }
+  };
+
+  explicit Telemetry(const Device& device, unsigned metrics = all & ~pcie)
+      : device_(device), metrics_(metrics) {
+#if defined(NVML_FI_DEV_POWER_INSTANT)
+    if (metrics_ & power) {
+      addField(NVML_FI_DEV_POWER_INSTANT, power);
+    }
+#endif
+#if defined(NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION)
+    if (metrics_ & energy) {
+      addField(NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION, energy);
+    }
+#endif
+    // Drop the fields that are not supported, such that the corresponding
+    // metrics fall back to their dedicated query, then drop the metrics that
+    // are not supported at all
+    if (!fields_.empty()) {
+      std::vector<nvmlFieldValue_t> values = fields_;
+      const int count = static_cast<int>(values.size());
+      if (nvmlDeviceGetFieldValues(device_, count, values.data()) ==
+          NVML_SUCCESS) {
+        for (size_t i = values.size(); i-- > 0;) {
+          if (values[i].nvmlReturn != NVML_SUCCESS) {
+            fields_.erase(fields_.begin() + i);
+            fieldMetrics_.erase(fieldMetrics_.begin() + i);
+          }
+        }
+      } else {
+        fields_.clear();
+        fieldMetrics_.clear();
+      }
+    }
+    metrics_ = collect().valid;
+  }
+
+  unsigned getMetrics() const { return metrics_; }
+
+  Snapshot collect() const {
+    Snapshot snapshot{};
+    unsigned batched = 0;
+
+    if (!fields_.empty()) {
+      std::vector<nvmlFieldValue_t> values = fields_;
+      const int count = static_cast<int>(values.size());
+      if (nvmlDeviceGetFieldValues(device_, count, values.data()) ==
+          NVML_SUCCESS) {
+        for (size_t i = 0; i < values.size(); i++) {
+          if (values[i].nvmlReturn != NVML_SUCCESS) {
+            continue;
+          }
+          const unsigned long long value = toUnsigned(values[i]);
+          if (fieldMetrics_[i] == power) {
+            snapshot.power = static_cast<unsigned int>(value);
+          } else if (fieldMetrics_[i] == energy) {
+            snapshot.energy = value;
+          }
+          snapshot.valid |= fieldMetrics_[i];
+        }
+      }
+      for (Metric metric : fieldMetrics_) {
+        batched |= metric;
+      }
+    }
+
+    if ((metrics_ & clocks) &&
+        nvmlDeviceGetClockInfo(device_, NVML_CLOCK_GRAPHICS,
+                               &snapshot.graphicsClock) == NVML_SUCCESS &&
+        nvmlDeviceGetClockInfo(device_, NVML_CLOCK_SM, &snapshot.smClock) ==
+            NVML_SUCCESS &&
+        nvmlDeviceGetClockInfo(device_, NVML_CLOCK_MEM,
+                               &snapshot.memoryClock) == NVML_SUCCESS) {
+      snapshot.valid |= clocks;
+    }
+
+    if ((metrics_ & power) && !(batched & power) &&
+        nvmlDeviceGetPowerUsage(device_, &snapshot.power) == NVML_SUCCESS) {
+      snapshot.valid |= power;
+    }
+
+    if ((metrics_ & energy) && !(batched & energy) &&
+        nvmlDeviceGetTotalEnergyConsumption(device_, &snapshot.energy) ==
+            NVML_SUCCESS) {
+      snapshot.valid |= energy;
+    }
+
+    if ((metrics_ & temperature) &&
+        nvmlDeviceGetTemperature(device_, NVML_TEMPERATURE_GPU,
+                                 &snapshot.temperature) == NVML_SUCCESS) {
+      snapshot.valid |= temperature;
+    }
+
+    nvmlUtilization_t utilizationRates;
+    if ((metrics_ & utilization) &&
+        nvmlDeviceGetUtilizationRates(device_, &utilizationRates) ==
+            NVML_SUCCESS) {
+      snapshot.gpuUtilization = utilizationRates.gpu;
+      snapshot.memoryUtilization = utilizationRates.memory;
+      snapshot.valid |= utilization;
+    }
+
+    nvmlMemory_t memoryInfo;
+    if ((metrics_ & memory) &&
+        nvmlDeviceGetMemoryInfo(device_, &memoryInfo) == NVML_SUCCESS) {
+      snapshot.memoryUsed = memoryInfo.used;
+      snapshot.memoryTotal = memoryInfo.total;
+      snapshot.valid |= memory;
+    }
+
+    if ((metrics_ & throttleReasons) &&
+        nvmlDeviceGetCurrentClocksThrottleReasons(
+            device_, &snapshot.throttleReasons) == NVML_SUCCESS) {
+      snapshot.valid |= throttleReasons;
+    }
+
+    if ((metrics_ & pcie) &&
+        nvmlDeviceGetPcieThroughput(device_, NVML_PCIE_UTIL_TX_BYTES,
+                                    &snapshot.pcieTx) == NVML_SUCCESS &&
+        nvmlDeviceGetPcieThroughput(device_, NVML_PCIE_UTIL_RX_BYTES,
+                                    &snapshot.pcieRx) == NVML_SUCCESS) {
+      snapshot.valid |= pcie;
+    }
+
+    return snapshot;
+  }
+
+ private:
+  void addField(unsigned int fieldId, Metric metric) {
+    nvmlFieldValue_t field{};
+    field.fieldId = fieldId;
+    fields_.push_back(field);
+    fieldMetrics_.push_back(metric);
+  }
+
+  static unsigned long long toUnsigned(const nvmlFieldValue_t& field) {
+    switch (field.valueType) {
+      case NVML_VALUE_TYPE_DOUBLE:
+        return static_cast<unsigned long long>(field.value.dVal);
+      case NVML_VALUE_TYPE_UNSIGNED_INT:
+        return field.value.uiVal;
+      case NVML_VALUE_TYPE_UNSIGNED_LONG:
+        return field.value.ulVal;
+      case NVML_VALUE_TYPE_SIGNED_LONG_LONG:
+        return static_cast<unsigned long long>(field.value.sllVal);
+      default:
+        return field.value.ullVal;
+    }
+  }
+
+  Context context_;
+  Device device_;
+  unsigned metrics_;
+  std::vector<nvmlFieldValue_t> fields_;
+  std::vector<Metric> fieldMetrics_;
+};
+
+/*
+ * EnergyBenchmark
+ *
+ * Measures the time and energy of a workload that is enqueued on a stream,
+ * e.g. a kernel launch. The workload is repeated until a measurement window
+ * exceeds the given duration, which should be well above the update interval
+ * of the NVML power and energy readings. Every statistic is the mean over a
+ * number of windows with the half-width of its 95% confidence interval.
+ */
+class EnergyBenchmark {
+ public:
+  struct Options {
+    std::chrono::milliseconds window{200};
+    unsigned int windows{5};
+    // Lock the GPU clock to its base clock when permitted, see ClockLock
+    bool lockClocks{false};
+  };
+
+  struct Statistic {
+    double mean;
+    double confidence;  // half-width of the 95% confidence interval
+  };
+
+  struct Result {
+    Statistic seconds;        // per call
+    Statistic joules;         // per call
+    Statistic watts;          // average power
+    Statistic callsPerJoule;  // performance per watt
+    size_t callsPerWindow;
+    bool clocksLocked;
+    ClockState clocks;  // as observed during the measurement
+  };
+
+  EnergyBenchmark(Device& device, cu::Stream& stream)
+      : EnergyBenchmark(device, stream, Options()) {}
+
+  EnergyBenchmark(Device& device, cu::Stream& stream, const Options& options)
+      : device_(device), stream_(stream), options_(options) {}
+
+  Result run(const std::function<void(cu::Stream&)>& workload) {
+    Result result{};
+
+    std::unique_ptr<ClockLock> lock;
+    if (options_.lockClocks) {
+      try {
+        lock.reset(new ClockLock(ClockLock::lockBaseClocks(device_)));
+      } catch (Error&) {
+        // Insufficient permissions or not supported: measure anyway
+      }
+    }
+    result.clocksLocked = lock != nullptr;
+
+    // Time a single call (after a warm-up call) to size the windows
+    cu::Event start, end;
+    workload(stream_);
+    stream_.record(start);
+    workload(stream_);
+    stream_.record(end);
+    end.synchronize();
+    const double window =
+        std::chrono::duration<double>(options_.window).count();
+    const double seconds = std::max(end.elapsedTime(start) * 1e-3, 1e-9);
+    result.callsPerWindow =
+        std::max(static_cast<size_t>(std::ceil(window / seconds)), size_t(1));
+
+    PowerSampler sampler(device_);
+    std::vector<double> time, energy, power, efficiency;
+    for (unsigned int i = 0; i < options_.windows; i++) {
+      sampler.begin("window");
+      stream_.record(start);
+      for (size_t call = 0; call < result.callsPerWindow; call++) {
+        workload(stream_);
+      }
+      stream_.record(end);
+      if (i == 0) {
+        result.clocks = device_.getClockState();
+      }
+      end.synchronize();
+      const PowerSampler::Region region = sampler.end();
+
+      const double calls = static_cast<double>(result.callsPerWindow);
+      time.push_back(end.elapsedTime(start) * 1e-3 / calls);
+      energy.push_back(region.joules / calls);
+      power.push_back(region.watts);
+      efficiency.push_back(region.joules > 0 ? calls / region.joules : 0);
+    }
+
+    result.seconds = statistic(time);
+    result.joules = statistic(energy);
+    result.watts = statistic(power);
+    result.callsPerJoule = statistic(efficiency);
+    return result;
+  }
+
+  Result run(cu::Function& function, unsigned gridX, unsigned gridY,
+             unsigned gridZ, unsigned blockX, unsigned blockY,
+             unsigned blockZ, unsigned sharedMemBytes,
+             const std::vector<const void*>& parameters) {
+    return run([&](cu::Stream& stream) {
+      stream.launchKernel(function, gridX, gridY, gridZ, blockX, blockY,
+                          blockZ, sharedMemBytes, parameters);
+    });
+  }
+
+ private:
+  static Statistic statistic(const std::vector<double>& values) {
+    const size_t n = values.size();
+    Statistic result{0, 0};
+    for (double value : values) {
+      result.mean += value / n;
+    }
+    if (n > 1) {
+      double variance = 0;
+      for (double value : values) {
+        variance += (value - result.mean) * (value - result.mean) / (n - 1);
+      }
+      result.confidence = studentT(n - 1) * std::sqrt(variance / n);
+    }
+    return result;
+  }
+
+  // Two-sided 95% critical value of Student's t-distribution
+  static double studentT(size_t degreesOfFreedom) {
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571,
+                                   2.447,  2.365, 2.306, 2.262, 2.228,
+                                   2.201,  2.179, 2.160, 2.145, 2.131,
+                                   2.120,  2.110, 2.101, 2.093, 2.086};
+    const size_t size = sizeof(table) / sizeof(table[0]);
+    return degreesOfFreedom <= size ? table[degreesOfFreedom - 1] : 1.96;
+  }
+
+  Device device_;
+  cu::Stream& stream_;
+  Options options_;
+};
+
+/*
+ * LinkMonitor
+ *
+ * Correlates the traffic on the PCIe and NVLink links of a device with the
+ * bytes copied through cu::Stream and the cu::memcpy functions, to tell
+ * whether a drop in copy bandwidth is caused by the link itself (replays),
+ * by traffic from elsewhere, or by the copies that were submitted. NVML only
+ * reports the PCIe throughput of the last 20 ms, hence it is sampled on a
+ * background thread and integrated over time. Note that cu::Counters is
+ * process-wide: with multiple devices, the submitted bytes include the
+ * copies to and from the other devices.
+ */
+class LinkMonitor {
+ public:
+  struct Window {
+    double seconds;
+    // Bytes copied through cudawrappers
+    unsigned long long submittedHtoD;
+    unsigned long long submittedDtoH;
+    // Bytes received (RX) and transmitted (TX) by the device
+    double pcieRx;
+    double pcieTx;
+    unsigned long long nvlinkRx;
+    unsigned long long nvlinkTx;
+    unsigned int pcieReplays;
+    unsigned long long nvlinkReplays;
+    double pcieBandwidth;  // theoretical, bytes/s per direction
+    // Fraction of the theoretical bandwidth that was used on the link, and
+    // that was achieved by the submitted copies
+    double linkUtilizationRx;
+    double linkUtilizationTx;
+    double copyUtilizationHtoD;
+    double copyUtilizationDtoH;
+  };
+
+  explicit LinkMonitor(
+      const Device& device,
+      std::chrono::microseconds interval = std::chrono::milliseconds(20))
+      : device_(device), interval_(interval) {
+    try {
+      pcieBandwidth_ = device_.getPcieBandwidth();
+    } catch (Error&) {
+      pcieBandwidth_ = 0;
+    }
+    last_ = std::chrono::steady_clock::now();
+    thread_ = std::thread([this] { run(); });
+  }
+
+  LinkMonitor(const LinkMonitor&) = delete;
+  LinkMonitor& operator=(const LinkMonitor&) = delete;
+
+  ~LinkMonitor() {
+    running_.store(false, std::memory_order_relaxed);
+    thread_.join();
+  }
+
+  void begin() { begin_ = read(); }
+
+  Window end() {
+    const State end = read();
+    Window window{};
+    window.seconds =
+        std::chrono::duration<double>(end.time - begin_.time).count();
+    window.submittedHtoD = end.submittedHtoD - begin_.submittedHtoD;
+    window.submittedDtoH = end.submittedDtoH - begin_.submittedDtoH;
+    window.pcieRx = end.pcieRx - begin_.pcieRx;
+    window.pcieTx = end.pcieTx - begin_.pcieTx;
+    window.nvlinkRx = (end.nvlinkRx - begin_.nvlinkRx) * 1024;
+    window.nvlinkTx = (end.nvlinkTx - begin_.nvlinkTx) * 1024;
+    window.pcieReplays = end.pcieReplays - begin_.pcieReplays;
+    window.nvlinkReplays = end.nvlinkReplays - begin_.nvlinkReplays;
+    window.pcieBandwidth = pcieBandwidth_;
+    if (window.seconds > 0 && pcieBandwidth_ > 0) {
+      const double bytes = pcieBandwidth_ * window.seconds;
+      window.linkUtilizationRx = window.pcieRx / bytes;
+      window.linkUtilizationTx = window.pcieTx / bytes;
+      window.copyUtilizationHtoD = window.submittedHtoD / bytes;
+      window.copyUtilizationDtoH = window.submittedDtoH / bytes;
+    }
+    return window;
+  }
+
+ private:
+  struct State {
+    std::chrono::steady_clock::time_point time;
+    unsigned long long submittedHtoD;
+    unsigned long long submittedDtoH;
+    double pcieRx;
+    double pcieTx;
+    unsigned long long nvlinkRx;
+    unsigned long long nvlinkTx;
+    unsigned int pcieReplays;
+    unsigned long long nvlinkReplays;
+  };
+
+  // Counters that are not supported by the device are left at zero
+  State read() {
+    State state{};
+    state.submittedHtoD = cu::getCounters().bytesCopiedHtoD;
+    state.submittedDtoH = cu::getCounters().bytesCopiedDtoH;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      state.time = std::chrono::steady_clock::now();
+      integrate(state.time);
+      state.pcieRx = pcieRx_;
+      state.pcieTx = pcieTx_;
+    }
+    nvmlDeviceGetPcieReplayCounter(device_, &state.pcieReplays);
+    try {
+      device_.getNvLinkThroughput(state.nvlinkTx, state.nvlinkRx);
+      state.nvlinkReplays = device_.getNvLinkReplayCounter();
+    } catch (Error&) {
+    }
+    return state;
+  }
+
+  // Accumulate the bytes transferred since the last sample, assuming the
+  // most recent throughput was sustained. Must hold mutex_.
+  void integrate(std::chrono::steady_clock::time_point time) {
+    const double seconds = std::chrono::duration<double>(time - last_).count();
+    pcieRx_ += rxThroughput_ * 1e3 * seconds;
+    pcieTx_ += txThroughput_ * 1e3 * seconds;
+    last_ = time;
+  }
+
+  void run() {
+    auto next = std::chrono::steady_clock::now();
+    while (running_.load(std::memory_order_relaxed)) {
+      next += interval_;
+      std::this_thread::sleep_until(next);
+      unsigned int rx = 0;
+      unsigned int tx = 0;
+      nvmlDeviceGetPcieThroughput(device_, NVML_PCIE_UTIL_RX_BYTES, &rx);
+      nvmlDeviceGetPcieThroughput(device_, NVML_PCIE_UTIL_TX_BYTES, &tx);
+      std::lock_guard<std::mutex> lock(mutex_);
+      integrate(std::chrono::steady_clock::now());
+      rxThroughput_ = rx;
+      txThroughput_ = tx;
+    }
+  }
+
+  Context context_;
+  Device device_;
+  std::chrono::microseconds interval_;
+  double pcieBandwidth_;
+  State begin_{};
+  std::mutex mutex_;
+  std::chrono::steady_clock::time_point last_;
+  unsigned int rxThroughput_{0};  // KB/s
+  unsigned int txThroughput_{0};
+  double pcieRx_{0};
+  double pcieTx_{0};
+  std::atomic<bool> running_{true};
+  std::thread thread_;
+};
+
+/*
+ * DeviceLoadSource
+ *
+ * Reports the load of CUDA devices (by ordinal) to cu::DeviceSelector, e.g.
+ * cu::DeviceSelector selector(count, nvml::DeviceLoadSource());
+ */
+class DeviceLoadSource {
+ public:
+  cu::DeviceLoad operator()(int ordinal) {
+    const Device& device = getDevice(ordinal);
+    const nvmlMemory_t memory = device.getMemoryInfo();
+
+    cu::DeviceLoad load{};
+    load.utilization = device.getUtilizationRates().gpu * 1e-2;
+    load.freeMemory = memory.free;
+    load.totalMemory = memory.total;
+    load.processes = device.getComputeRunningProcessCount();
+    try {
+      load.power = device.getPower() * 1e-3;
+      load.powerLimit = device.getPowerManagementLimit() * 1e-3;
+    } catch (Error&) {
+      // Power readings are not available on all devices
+    }
+    return load;
+  }
+
+ private:
+  const Device& getDevice(int ordinal) {
+    auto device = devices_.find(ordinal);
+    if (device == devices_.end()) {
+      cu::Device cuDevice(ordinal);
+      device = devices_.emplace(ordinal, Device(cuDevice)).first;
+    }
+    return device->second;
+  }
+
+  Context context_;
+  std::map<int, Device> devices_;
+};
 }  // namespace nvml
 
 #endif  //  __HIP_PLATFORM_AMD__
@@ -1,9 +1,18 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <catch2/catch_template_test_macros.hpp>
 #include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include <cudawrappers/cu.hpp>
 
@@ -400,3 +409,814 @@ TEST_CASE("Test cu::Stream", "[stream]") {
     CHECK_NOTHROW(stream.synchronize());
   }
 }
+
+TEST_CASE("Test cu::Counters", "[counters]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  const cu::Counters &counters = cu::getCounters();
+  const uint64_t allocations = counters.deviceAllocations;
+  const uint64_t deviceBytes = counters.deviceBytes;
+  const uint64_t bytesCopiedHtoD = counters.bytesCopiedHtoD;
+  const uint64_t bytesCopiedDtoH = counters.bytesCopiedDtoH;
+  const uint64_t synchronizations = counters.synchronizations;
+
+  const std::array<int, 3> src = {1, 2, 3};
+  std::array<int, 3> tgt = {0, 0, 0};
+  const size_t size = sizeof(src);
+
+  {
+    cu::DeviceMemory mem(size);
+    CHECK(counters.deviceAllocations == allocations + 1);
+    CHECK(counters.deviceBytes == deviceBytes + size);
+
+    cu::Stream stream;
+    stream.memcpyHtoDAsync(mem, src.data(), size);
+    stream.memcpyDtoHAsync(tgt.data(), mem, size);
+    stream.synchronize();
+  }
+
+  CHECK(counters.deviceBytes == deviceBytes);
+  CHECK(counters.bytesCopiedHtoD == bytesCopiedHtoD + size);
+  CHECK(counters.bytesCopiedDtoH == bytesCopiedDtoH + size);
+  CHECK(counters.synchronizations == synchronizations + 1);
+}
+
+TEST_CASE("Test cu::DeviceSelector", "[deviceselector]") {
+  const size_t gb = 1024 * 1024 * 1024;
+  std::array<cu::DeviceLoad, 3> loads = {
+      cu::DeviceLoad{0.9, 8 * gb, 16 * gb, 0, 0, 2},
+      cu::DeviceLoad{0.1, 4 * gb, 16 * gb, 0, 0, 0},
+      cu::DeviceLoad{0.2, 12 * gb, 16 * gb, 0, 0, 0}};
+  cu::DeviceSelector selector(
+      loads.size(), [&](int ordinal) { return loads[ordinal]; });
+
+  SECTION("Rank devices by load") {
+    CHECK(selector.rank() == std::vector<int>{2, 1, 0});
+    CHECK(selector.rank(6 * gb) == std::vector<int>{2, 0});
+  }
+
+  SECTION("Select the least loaded device with enough memory") {
+    CHECK(selector.selectOrdinal(6 * gb) == 2);
+    CHECK_THROWS_AS(selector.selectOrdinal(16 * gb), cu::Error);
+  }
+
+  SECTION("Stick to the previous device within the hysteresis margin") {
+    CHECK(selector.selectOrdinal() == 2);
+    loads[2].utilization = 0.65;
+    CHECK(selector.selectOrdinal() == 2);
+    loads[2].utilization = 0.8;
+    CHECK(selector.selectOrdinal() == 1);
+  }
+}
+
+TEST_CASE("Test staged copies", "[staging]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  // A size that is not a multiple of the chunk size, to test the last chunk
+  const size_t n = 100000;
+  const size_t size = n * sizeof(int);
+  std::vector<int> src(n);
+  std::vector<int> tgt(n, 0);
+  std::iota(src.begin(), src.end(), 0);
+
+  SECTION("Detect pageable memory") {
+    cu::HostMemory pinned(size);
+    cu::detail::HostRangeCache &cache = cu::detail::getHostRangeCache();
+    CHECK(cache.isPageable(src.data(), size));
+    CHECK_FALSE(cache.isPageable(pinned, size));
+    CHECK_FALSE(cache.isPageable(static_cast<char *>(pinned) + 64, 64));
+  }
+
+  SECTION("Copy through the staging buffers") {
+    cu::DeviceMemory mem(size);
+    cu::Stream stream;
+    stream.enableStaging(16 * 1024, 3);
+    stream.memcpyHtoDAsync(mem, src.data(), size);
+    stream.memcpyDtoHAsync(tgt.data(), mem, size);
+    stream.synchronize();
+    CHECK(src == tgt);
+  }
+
+  SECTION("Copy with a custom host copy function") {
+    cu::DeviceMemory mem(size);
+    cu::Stream stream;
+    std::atomic<size_t> copied{0};
+    stream.enableStaging(std::make_shared<cu::StagingRing>(
+        64 * 1024, 2, [&](void *to, const void *from, size_t bytes) {
+          std::memcpy(to, from, bytes);
+          copied += bytes;
+        }));
+    stream.memcpyHtoDAsync(mem, src.data(), size);
+    stream.memcpyDtoHAsync(tgt.data(), mem, size);
+    stream.synchronize();
+    CHECK(src == tgt);
+    CHECK(copied == 2 * size);
+  }
+}
+
+TEST_CASE("Test cu::HostCopyEngine", "[hostcopy]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::HostCopyEngine engine(4, device.getNumaNode());
+
+  SECTION("Copy unaligned ranges") {
+    const size_t size = 8 * 1024 * 1024 + 3;
+    std::vector<char> src(size + 1);
+    std::iota(src.begin(), src.end(), 0);
+    cu::HostMemory tgt(size + 2);
+    char *dst = static_cast<char *>(tgt);
+    std::memset(dst, 0, size + 2);
+    engine.copy(dst + 1, src.data() + 1, size);
+    CHECK(dst[0] == 0);
+    CHECK(std::equal(src.begin() + 1, src.end(), dst + 1));
+    CHECK(dst[size + 1] == 0);
+  }
+
+  SECTION("Benchmark against memcpy") {
+    const cu::HostCopyEngine::Benchmark result =
+        engine.benchmark(64 * 1024 * 1024, 2);
+    CHECK(result.engineBandwidth > 0);
+    CHECK(result.memcpyBandwidth > 0);
+  }
+}
+
+TEST_CASE("Test cu::HostMemory with huge pages", "[hostmemory]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  const size_t size = 64 * 1024 * 1024 + 5;
+  cu::HostMemory::HugePageReport report;
+  cu::HostMemory h_memory = cu::HostMemory::allocateHugePages(
+      size, 0, device.getNumaNode(), &report);
+
+  CHECK(h_memory.size() == size);
+  CHECK(report.pageSize >= 4096);
+  CHECK(report.registerSeconds >= 0);
+  if (report.hugePages) {
+    CHECK(report.pageSize > 4096);
+  }
+  CHECK_FALSE(cu::detail::getHostRangeCache().isPageable(h_memory, size));
+
+  char *data = h_memory;
+  std::memset(data, 42, size);
+  cu::DeviceMemory d_memory(size);
+  cu::Stream stream;
+  stream.memcpyHtoDAsync(d_memory, data, size);
+  std::memset(data, 0, size);
+  stream.memcpyDtoHAsync(data, d_memory, size);
+  stream.synchronize();
+  CHECK(data[0] == 42);
+  CHECK(data[size - 1] == 42);
+}
+
+TEST_CASE("Test cu::PinnedAllocator and cu::ManagedAllocator", "[allocator]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  const size_t n = 1000;
+  const cu::Counters &counters = cu::getCounters();
+
+  SECTION("Copy from a pinned vector") {
+    {
+      std::vector<float, cu::PinnedAllocator<float>> src(n);
+      std::vector<float, cu::PinnedAllocator<float>> tgt(n, 0);
+      std::iota(src.begin(), src.end(), 0.0f);
+      CHECK_FALSE(cu::detail::getHostRangeCache().isPageable(src.data(),
+                                                             sizeof(float)));
+
+      cu::DeviceMemory mem(n * sizeof(float));
+      cu::Stream stream;
+      stream.memcpyHtoDAsync(mem, src.data(), n * sizeof(float));
+      stream.memcpyDtoHAsync(tgt.data(), mem, n * sizeof(float));
+      stream.synchronize();
+      CHECK(src == tgt);
+    }
+    cu::releaseCachedMemory();
+  }
+
+  SECTION("Reuse cached blocks") {
+    cu::releaseCachedMemory();
+    { std::vector<int, cu::PinnedAllocator<int>> warmup(n); }
+    const uint64_t hits = counters.poolHits;
+    const uint64_t misses = counters.poolMisses;
+    { std::vector<int, cu::PinnedAllocator<int>> vector(n); }
+    CHECK(counters.poolHits == hits + 1);
+    CHECK(counters.poolMisses == misses);
+    cu::releaseCachedMemory();
+  }
+
+  SECTION("Access a managed vector on the host") {
+    cu::releaseCachedMemory();
+    {
+      std::vector<int, cu::ManagedAllocator<int>> vector(n, 1);
+      CHECK(std::accumulate(vector.begin(), vector.end(), 0) == n);
+    }
+    cu::releaseCachedMemory();
+  }
+
+  SECTION("Do not reuse blocks of a destroyed context") {
+    cu::releaseCachedMemory();
+    {
+      cu::Context other(CU_CTX_SCHED_BLOCKING_SYNC, device);
+      std::vector<int, cu::PinnedAllocator<int>> vector(n);
+    }
+    context.setCurrent();
+    const uint64_t hits = counters.poolHits;
+    { std::vector<int, cu::PinnedAllocator<int>> vector(n); }
+    CHECK(counters.poolHits == hits);
+    cu::releaseCachedMemory();
+  }
+}
+
+TEST_CASE("Test cu::FileLoader", "[fileloader]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  const std::string path = "test_fileloader.bin";
+  const size_t n = 100000;
+  const size_t size = n * sizeof(int);
+  std::vector<int> src(n);
+  std::iota(src.begin(), src.end(), 0);
+  std::ofstream(path, std::ios::binary)
+      .write(reinterpret_cast<const char *>(src.data()), size);
+
+  cu::FileLoader::Options options;
+  options.chunkSize = 16 * 1024;
+  options.chunks = 3;
+  options.direct = true;
+  cu::FileLoader loader(path, options);
+  CHECK(loader.size() == size);
+
+  cu::DeviceMemory mem(size);
+  cu::Stream stream;
+  std::vector<int> tgt(n, 0);
+
+  SECTION("Load the whole file") {
+    const cu::FileLoader::Result result = loader.load(stream, mem);
+    CHECK(result.bytes == size);
+    CHECK(result.bandwidth > 0);
+    stream.memcpyDtoHAsync(tgt.data(), mem, size);
+    stream.synchronize();
+    CHECK(src == tgt);
+  }
+
+  SECTION("Load at an unaligned offset") {
+    const size_t offset = 5 * options.chunkSize + 3 * sizeof(int);
+    loader.load(stream, mem, size - offset, offset);
+    stream.memcpyDtoHAsync(tgt.data(), mem, size - offset);
+    stream.synchronize();
+    CHECK(std::equal(src.begin() + offset / sizeof(int), src.end(),
+                     tgt.begin()));
+  }
+
+  SECTION("Load beyond the end of the file") {
+    CHECK_THROWS(loader.load(stream, mem, size, sizeof(int)));
+  }
+
+  SECTION("Load through a single buffer") {
+    options.chunks = 1;
+    cu::FileLoader single(path, options);
+    single.load(stream, mem);
+    stream.memcpyDtoHAsync(tgt.data(), mem, size);
+    stream.synchronize();
+    CHECK(src == tgt);
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Test cu::FileWriter", "[filewriter]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  const std::string path = "test_filewriter.bin";
+  const size_t n = 100000;
+  const size_t size = n * sizeof(int);
+  std::vector<int> src(n);
+  std::iota(src.begin(), src.end(), 0);
+
+  cu::DeviceMemory mem(size);
+  cu::Stream stream;
+  stream.memcpyHtoDAsync(mem, src.data(), size);
+
+  cu::FileWriter::Options options;
+  options.chunkSize = 16 * 1024;
+  options.chunks = 2;
+  options.direct = true;
+  {
+    cu::FileWriter writer(path, options);
+    const size_t first = 4 * options.chunkSize;
+    writer.write(stream, mem, first);
+    cu::DeviceMemory rest(mem, first, size - first);
+    writer.write(stream, rest, size - first);
+    CHECK(writer.size() == size);
+    if (writer.isDirect()) {
+      CHECK_THROWS_AS(writer.write(stream, mem, sizeof(int)),
+                      std::invalid_argument);
+    }
+    writer.flush();
+  }
+
+  std::vector<int> tgt(n, 0);
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  CHECK(static_cast<size_t>(file.tellg()) == size);
+  file.seekg(0);
+  file.read(reinterpret_cast<char *>(tgt.data()), size);
+  CHECK(src == tgt);
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Test cu::Pipeline", "[pipeline]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  const size_t n = 1024;
+  const size_t size = n * sizeof(int);
+  const size_t chunks = 8;
+
+  cu::Pipeline pipeline(
+      size, size,
+      [&](cu::Stream &stream, cu::Pipeline::Slot &slot, size_t chunk) {
+        int *input = slot.hostInput;
+        std::fill(input, input + n, static_cast<int>(chunk));
+        stream.memcpyHtoDAsync(slot.deviceInput, input, size);
+      },
+      [&](cu::Stream &stream, cu::Pipeline::Slot &slot, size_t) {
+        stream.memcpyDtoDAsync(slot.deviceOutput, slot.deviceInput, size);
+      },
+      [&](cu::Stream &stream, cu::Pipeline::Slot &slot, size_t) {
+        stream.memcpyDtoHAsync(slot.hostOutput, slot.deviceOutput, size);
+      },
+      3);
+
+  std::vector<size_t> completed;
+  pipeline.setCompletion([&](cu::Pipeline::Slot &slot, size_t chunk) {
+    const int *output = slot.hostOutput;
+    CHECK(std::all_of(output, output + n, [&](int value) {
+      return value == static_cast<int>(chunk);
+    }));
+    completed.push_back(chunk);
+  });
+  pipeline.run(chunks);
+
+  std::vector<size_t> expected(chunks);
+  std::iota(expected.begin(), expected.end(), 0);
+  CHECK(completed == expected);
+
+  const cu::Pipeline::Statistics &statistics = pipeline.getStatistics();
+  CHECK(statistics.chunks == chunks);
+  CHECK(statistics.seconds > 0);
+  CHECK(statistics.upload > 0);
+  CHECK(statistics.compute > 0);
+  CHECK(statistics.download > 0);
+}
+
+TEST_CASE("Test cu::TransferBatcher", "[transferbatcher]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t n = 4096;
+  cu::DeviceMemory mem(n * sizeof(int));
+  stream.zero(mem, n * sizeof(int));
+  const CUdeviceptr ptr = mem;
+
+  cu::TransferBatcher::Options options;
+  options.capacity = 16 << 10;
+  options.maxTransferSize = 1024;
+  options.maxDelay = std::chrono::seconds(1);
+
+  SECTION("Test batched copies") {
+    cu::TransferBatcher batcher(stream, options);
+    for (size_t i = 0; i < n; i++) {
+      const int value = static_cast<int>(i);
+      batcher.memcpyHtoDAsync(ptr + i * sizeof(int), &value, sizeof(int));
+    }
+    batcher.flush();
+    CHECK(batcher.pending() == 0);
+    CHECK(batcher.getStatistics().copies == n);
+    CHECK(batcher.getStatistics().batches < n / 64);
+  }
+
+  SECTION("Test scatter kernel and unbatched copies") {
+    options.useBatchApi = false;
+    cu::TransferBatcher batcher(stream, options);
+    CHECK(!batcher.usesBatchApi());
+    std::vector<int> large(n / 2);
+    std::iota(large.begin(), large.end(), static_cast<int>(n / 2));
+    for (size_t i = 0; i < n / 2; i++) {
+      const int value = static_cast<int>(i);
+      batcher.memcpyHtoDAsync(ptr + i * sizeof(int), &value, sizeof(int));
+    }
+    batcher.memcpyHtoDAsync(ptr + n / 2 * sizeof(int), large.data(),
+                            large.size() * sizeof(int));
+    CHECK(batcher.pending() == 0);
+  }
+
+  std::vector<int> result(n);
+  stream.memcpyDtoHAsync(result.data(), mem, n * sizeof(int));
+  stream.synchronize();
+  std::vector<int> expected(n);
+  std::iota(expected.begin(), expected.end(), 0);
+  CHECK(result == expected);
+}
+
+TEST_CASE("Test cu::CopyScheduler", "[copyscheduler]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t n = 1 << 20;
+  const size_t size = n * sizeof(int);
+  cu::HostMemory input(size);
+  cu::HostMemory output(size);
+  cu::HostMemory other(size);
+  cu::DeviceMemory memA(size);
+  cu::DeviceMemory memB(size);
+  int *inputPtr = input;
+  std::iota(inputPtr, inputPtr + n, 0);
+  std::fill_n(static_cast<int *>(other), n, 42);
+  stream.memcpyHtoDAsync(memB, other, size);
+
+  cu::CopyScheduler::Options options;
+  options.chunkSize = size / 4;
+  cu::CopyScheduler scheduler(options);
+
+  // The download of memA must wait for its upload, the upload of input to
+  // memB must wait for the download of memB to other
+  scheduler.memcpyHtoDAsync(memA, input, size);
+  scheduler.memcpyDtoHAsync(other, memB, size);
+  scheduler.memcpyDtoHAsync(output, memA, size);
+  scheduler.memcpyHtoDAsync(memB, input, size);
+  scheduler.enqueue(stream);
+  stream.synchronize();
+
+  const cu::CopyScheduler::Result result = scheduler.synchronize();
+  CHECK(result.bytesHtoD == 2 * size);
+  CHECK(result.bytesDtoH == 2 * size);
+  CHECK(result.seconds > 0);
+  CHECK(result.bandwidth > 0);
+
+  const int *outputPtr = output;
+  const int *otherPtr = other;
+  CHECK(std::equal(inputPtr, inputPtr + n, outputPtr));
+  CHECK(std::all_of(otherPtr, otherPtr + n, [](int v) { return v == 42; }));
+
+  std::vector<int> resultB(n);
+  stream.memcpyDtoHAsync(resultB.data(), memB, size);
+  stream.synchronize();
+  CHECK(std::equal(inputPtr, inputPtr + n, resultB.begin()));
+}
+
+TEST_CASE("Test managed memory advice and attachment", "[devicememory]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t n = 1024;
+  const size_t size = n * sizeof(float);
+  cu::DeviceMemory mem(size, CU_MEMORYTYPE_UNIFIED, CU_MEM_ATTACH_GLOBAL);
+
+  SECTION("Test read mostly") {
+    mem.advise(CU_MEM_ADVISE_SET_READ_MOSTLY, size);
+    CHECK(mem.getRangeAttribute(CU_MEM_RANGE_ATTRIBUTE_READ_MOSTLY, size));
+    CHECK(mem.getRangeAttributes(size).readMostly);
+    mem.advise(CU_MEM_ADVISE_UNSET_READ_MOSTLY, size);
+    CHECK(!mem.getRangeAttributes(size).readMostly);
+  }
+
+  SECTION("Test preferred location and accessed by") {
+    mem.advise(CU_MEM_ADVISE_SET_PREFERRED_LOCATION, size, device);
+    mem.advise(CU_MEM_ADVISE_SET_ACCESSED_BY, size, device);
+    CHECK(mem.getRangeAttributes(size).preferredLocation ==
+          device.getOrdinal());
+    const std::vector<int> devices = mem.getAccessedBy(size);
+    CHECK(std::find(devices.begin(), devices.end(), device.getOrdinal()) !=
+          devices.end());
+  }
+
+  SECTION("Test attach to stream") {
+    stream.attachMemAsync(mem);
+    stream.memsetAsync(mem, static_cast<unsigned int>(0), n);
+    stream.synchronize();
+    const float *data = mem;
+    CHECK(std::all_of(data, data + n, [](float v) { return v == 0; }));
+  }
+}
+
+TEST_CASE("Test cu::ManagedStreamer", "[managedstreamer]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t windowSize = 1 << 20;
+  const size_t windows = 8;
+  const size_t size = windows * windowSize + windowSize / 2;
+  cu::DeviceMemory mem(size, CU_MEMORYTYPE_UNIFIED, CU_MEM_ATTACH_GLOBAL);
+
+  cu::ManagedStreamer streamer(mem, windowSize, device);
+  REQUIRE(streamer.getWindowCount() == windows + 1);
+
+  std::vector<size_t> indices;
+  streamer.run(stream, [&](cu::Stream &kernelStream, cu::DeviceMemory &window,
+                           size_t k) {
+    kernelStream.memsetAsync(window, static_cast<unsigned char>(k),
+                             window.size());
+    indices.push_back(k);
+  });
+
+  std::vector<size_t> expected(windows + 1);
+  std::iota(expected.begin(), expected.end(), 0);
+  CHECK(indices == expected);
+
+  const unsigned char *data = mem;
+  for (size_t k = 0; k <= windows; k++) {
+    CHECK(data[k * windowSize] == k);
+  }
+  CHECK(data[size - 1] == windows);
+
+  const cu::ManagedStreamer::Statistics &statistics = streamer.getStatistics();
+  CHECK(statistics.windows == windows + 1);
+  CHECK(statistics.bytesPrefetched == size);
+  CHECK(statistics.bytesEvicted == size);
+  CHECK(statistics.bandwidth > 0);
+}
+
+TEST_CASE("Test cu::MirroredBuffer", "[mirroredbuffer]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t n = 1024;
+  cu::MirroredBuffer<int> buffer(n);
+  CHECK(buffer.size() == n);
+  CHECK(buffer.isCoherent());
+
+  int *host = buffer.hostView(stream);
+  std::iota(host, host + n, 0);
+  buffer.markHostDirty();
+  CHECK(!buffer.isCoherent());
+  buffer.deviceView(stream);
+  CHECK(buffer.isCoherent());
+  CHECK(buffer.getStatistics().bytesCopiedHtoD == n * sizeof(int));
+
+  SECTION("Test coherent views do not copy") {
+    buffer.deviceView(stream);
+    buffer.hostView(stream);
+    CHECK(buffer.getStatistics().copies == 1);
+  }
+
+  SECTION("Test only dirty ranges are copied") {
+    cu::DeviceMemory range(buffer.getDeviceMemory(), 16 * sizeof(int),
+                           16 * sizeof(int));
+    stream.memsetAsync(range, static_cast<unsigned int>(0), 16);
+    buffer.markDeviceDirty(16, 16);
+    host[100] = -1;
+    buffer.markHostDirty(100, 1);
+
+    buffer.deviceView(stream);
+    host = buffer.hostView(stream);
+    stream.synchronize();
+    CHECK(buffer.isCoherent());
+    CHECK(buffer.getStatistics().bytesCopiedHtoD == (n + 1) * sizeof(int));
+    CHECK(buffer.getStatistics().bytesCopiedDtoH == 16 * sizeof(int));
+
+    std::vector<int> expected(n);
+    std::iota(expected.begin(), expected.end(), 0);
+    std::fill_n(expected.begin() + 16, 16, 0);
+    expected[100] = -1;
+    CHECK(std::equal(expected.begin(), expected.end(), host));
+
+    std::vector<int> device(n);
+    stream.memcpyDtoHAsync(device.data(), buffer.getDeviceMemory(),
+                           n * sizeof(int));
+    stream.synchronize();
+    CHECK(device == expected);
+  }
+}
+
+TEST_CASE("Test cu::DeviceArena", "[devicearena]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t capacity = 1 << 20;
+  cu::DeviceArena arena(capacity);
+  CHECK(arena.getCapacity() == capacity);
+
+  cu::DeviceMemory a = arena.allocate(100);
+  cu::DeviceMemory b = arena.allocate<float>(100);
+  CHECK(a.size() == 100);
+  CHECK(b.size() == 100 * sizeof(float));
+  CHECK(static_cast<char *>(b) - static_cast<char *>(a) == 256);
+  CHECK(arena.getUsed() == 256 + 100 * sizeof(float));
+  CHECK_THROWS(arena.allocate(capacity));
+
+  stream.memsetAsync(a, static_cast<unsigned char>(1), a.size());
+  stream.memsetAsync(b, static_cast<unsigned char>(2), b.size());
+  arena.reset(stream);
+  CHECK(arena.getUsed() == 0);
+
+  cu::DeviceMemory c = arena.allocate(capacity);
+  CHECK(static_cast<char *>(c) == static_cast<char *>(a));
+  cu::Stream other;
+  arena.wait(other);
+  other.memsetAsync(c, static_cast<unsigned char>(3), c.size());
+  arena.reset(other);
+  arena.synchronize();
+
+  const cu::DeviceArena::Statistics &statistics = arena.getStatistics();
+  CHECK(statistics.frames == 2);
+  CHECK(statistics.allocations == 3);
+  CHECK(statistics.lastFramePeak == capacity);
+  CHECK(statistics.peak == capacity);
+}
+
+TEST_CASE("Test release policies", "[release]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t size = 1 << 20;
+  const cu::Counters &counters = cu::getCounters();
+  const uint64_t deviceBytes = counters.deviceBytes;
+  const uint64_t hostBytes = counters.hostBytes;
+  const uint64_t deferredReleases = counters.deferredReleases;
+
+  SECTION("Test deferred release") {
+    cu::setReleasePolicy(cu::ReleasePolicy::Deferred);
+    CHECK(cu::getReleasePolicy() == cu::ReleasePolicy::Deferred);
+    std::vector<char> user(size);
+    {
+      cu::DeviceMemory mem(size);
+      cu::HostMemory host(size);
+      cu::HostMemory registered(user.data(), size);
+      cu::Array array(64, CU_AD_FORMAT_FLOAT, 1);
+    }
+    CHECK(counters.deferredReleases == deferredReleases + 3);
+    CHECK(counters.deferredBytes == 2 * size + 64 * sizeof(float));
+    // Memory of the caller is unregistered immediately
+    CHECK_NOTHROW(cu::HostMemory(user.data(), size));
+    CHECK(counters.deviceBytes == deviceBytes + size);
+    cu::releaseDeferred();
+    CHECK(counters.deferredBytes == 0);
+    CHECK(counters.deviceBytes == deviceBytes);
+    CHECK(counters.hostBytes == hostBytes);
+  }
+
+  SECTION("Test background release") {
+    cu::setReleasePolicy(cu::ReleasePolicy::Background);
+    for (int i = 0; i < 16; i++) {
+      cu::DeviceMemory mem(size);
+      stream.zero(mem, size);
+    }
+    cu::setReleasePolicy(cu::ReleasePolicy::Immediate);
+    CHECK(counters.deferredBytes == 0);
+    CHECK(counters.deviceBytes == deviceBytes);
+  }
+
+  SECTION("Test stream-ordered release") {
+    {
+      cu::DeviceMemory mem = stream.memAllocAsyncOwned(size);
+      stream.zero(mem, size);
+      CHECK(counters.deviceBytes == deviceBytes + size);
+    }
+    stream.synchronize();
+    CHECK(counters.deviceBytes == deviceBytes);
+  }
+
+  cu::setReleasePolicy(cu::ReleasePolicy::Immediate);
+}
+
+TEST_CASE("Test memory accounting", "[accounting]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+  cu::setMemoryAccounting(true);
+
+  const auto find = [&](cu::MemoryKind kind, const std::string &tag) {
+    for (const cu::MemoryUsage &usage : cu::getMemoryUsage()) {
+      if (usage.kind == kind && usage.tag == tag) {
+        return usage;
+      }
+    }
+    return cu::MemoryUsage{};
+  };
+
+  const size_t size = 1 << 20;
+  {
+    cu::MemoryTag tag("test-device");
+    cu::DeviceMemory a(size);
+    cu::DeviceMemory b(2 * size);
+    const cu::MemoryUsage usage = find(cu::MemoryKind::Device, "test-device");
+    CHECK(usage.device == device.getOrdinal());
+    CHECK(usage.allocations == 2);
+    CHECK(usage.bytes == 3 * size);
+  }
+  cu::MemoryUsage usage = find(cu::MemoryKind::Device, "test-device");
+  CHECK(usage.totalAllocations == 2);
+  CHECK(usage.allocations == 0);
+  CHECK(usage.bytes == 0);
+  CHECK(usage.peakBytes == 3 * size);
+
+  {
+    cu::MemoryTag tag("test-host");
+    cu::HostMemory host(size);
+    usage = find(cu::MemoryKind::Host, "test-host");
+    CHECK(usage.device == -1);
+    CHECK(usage.bytes == size);
+  }
+
+  {
+    cu::MemoryTag tag("test-async");
+    cu::DeviceMemory mem = stream.memAllocAsync(size);
+    CHECK(find(cu::MemoryKind::Async, "test-async").bytes == size);
+    stream.memFreeAsync(mem);
+    CHECK(find(cu::MemoryKind::Async, "test-async").bytes == 0);
+  }
+
+  cu::resetMemoryPeaks();
+  CHECK(find(cu::MemoryKind::Device, "test-device").peakBytes == 0);
+
+  std::ostringstream out;
+  cu::dumpMemoryUsage(out);
+  CHECK(out.str().find("test-device") != std::string::npos);
+
+  stream.synchronize();
+  cu::setMemoryAccounting(false);
+}
+
+TEST_CASE("Test hazard tracking", "[hazards]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream producer;
+  cu::Stream consumer;
+
+  const size_t size = 64 << 20;
+  cu::DeviceMemory mem(size);
+  cu::HostMemory host(size);
+  CHECK(!mem.isHazardTracked());
+  mem.enableHazardTracking();
+  CHECK(mem.isHazardTracked());
+  CHECK(cu::DeviceMemory(mem, 0, size / 2).isHazardTracked());
+
+  const auto waits = [] { return cu::getCounters().hazardWaits.load(); };
+
+  SECTION("Test read after write") {
+    const uint64_t before = waits();
+    producer.memsetAsync(mem, static_cast<unsigned char>(0xAB), size);
+    producer.memsetAsync(mem, static_cast<unsigned char>(0xCD), size);
+    CHECK(waits() == before);  // ordered by the stream
+    consumer.memcpyDtoHAsync(host, mem, size);
+    CHECK(waits() == before + 1);
+    consumer.synchronize();
+    const unsigned char *data = host;
+    CHECK(data[0] == 0xCD);
+    CHECK(data[size - 1] == 0xCD);
+  }
+
+  SECTION("Test write after read") {
+    producer.zero(mem, size);
+    consumer.memcpyDtoHAsync(host, mem, size);
+    const uint64_t before = waits();
+    producer.access({{mem, cu::Access::Write}}, [&] {
+      producer.memsetAsync(mem, static_cast<unsigned char>(1), size);
+    });
+    CHECK(waits() == before + 1);  // the read, the write is on this stream
+    consumer.synchronize();
+    producer.synchronize();
+    const unsigned char *data = host;
+    CHECK(data[size - 1] == 0);
+  }
+
+  SECTION("Test untracked memory") {
+    cu::DeviceMemory other(size);
+    const uint64_t before = waits();
+    producer.zero(other, size);
+    consumer.memcpyDtoHAsync(host, other, size);
+    CHECK(waits() == before);
+    consumer.synchronize();
+  }
+
+  producer.synchronize();
+}
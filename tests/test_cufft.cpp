@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 
@@ -241,3 +243,205 @@ TEST_CASE("Test 2D FFT", "[FFT2D]") {
     compare(out_ptr, in_ptr, height * width);
   }
 }
+
+TEST_CASE("Test 2D FFT with Real-To-Complex translation, and back",
+          "[FFT2DR2C]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t height = 256;
+  const size_t width = height;
+  const size_t complexWidth = width / 2 + 1;
+  const size_t patchSize = 10;
+
+  SECTION("FP32") {
+    const size_t realSize = height * width * sizeof(cufftReal);
+    const size_t complexSize = height * complexWidth * sizeof(cufftComplex);
+
+    cu::HostMemory h_in(realSize);
+    cu::HostMemory h_out(realSize);
+    cu::DeviceMemory d_in(realSize);
+    cu::DeviceMemory d_out(complexSize);
+    cu::DeviceMemory d_out2(realSize);
+
+    generateSignal(static_cast<cufftReal *>(h_in), height, width, patchSize,
+                   1.0f);
+    stream.memcpyHtoDAsync(d_in, h_in, realSize);
+
+    cufft::FFT2DR2C<CUDA_R_32F> fft_r2c{height, width};
+    cufft::FFT2DC2R<CUDA_C_32F> fft_c2r{height, width};
+    fft_r2c.setStream(stream);
+    fft_c2r.setStream(stream);
+
+    fft_r2c.execute(d_in, d_out, CUFFT_FORWARD);
+    fft_c2r.execute(d_out, d_out2, CUFFT_INVERSE);
+    stream.memcpyDtoHAsync(h_out, d_out2, realSize);
+    stream.synchronize();
+
+    cufftReal *in_ptr = static_cast<cufftReal *>(h_in);
+    cufftReal *out_ptr = static_cast<cufftReal *>(h_out);
+    for (size_t i = 0; i < height * width; i++) {
+      compare(out_ptr[i] / float(height * width), in_ptr[i]);
+    }
+  }
+
+  SECTION("FP32 batched") {
+    const size_t batch = 2;
+    const size_t dist = height * width;
+    const size_t realSize = batch * height * width * sizeof(cufftReal);
+    const size_t complexSize =
+        batch * height * complexWidth * sizeof(cufftComplex);
+
+    cu::HostMemory h_in(realSize);
+    cu::HostMemory h_out(realSize);
+    cu::DeviceMemory d_in(realSize);
+    cu::DeviceMemory d_out(complexSize);
+    cu::DeviceMemory d_out2(realSize);
+
+    generateSignal(static_cast<cufftReal *>(h_in), height, width, patchSize,
+                   1.0f);
+    generateSignal(static_cast<cufftReal *>(h_in) + dist, height, width,
+                   patchSize, 2.0f);
+    stream.memcpyHtoDAsync(d_in, h_in, realSize);
+
+    cufft::FFT2DR2C<CUDA_R_32F> fft_r2c{height, width, batch};
+    cufft::FFT2DC2R<CUDA_C_32F> fft_c2r{height, width, batch};
+    fft_r2c.setStream(stream);
+    fft_c2r.setStream(stream);
+
+    fft_r2c.execute(d_in, d_out, CUFFT_FORWARD);
+    fft_c2r.execute(d_out, d_out2, CUFFT_INVERSE);
+    stream.memcpyDtoHAsync(h_out, d_out2, realSize);
+    stream.synchronize();
+
+    cufftReal *in_ptr = static_cast<cufftReal *>(h_in);
+    cufftReal *out_ptr = static_cast<cufftReal *>(h_out);
+    for (size_t i = 0; i < batch * height * width; i++) {
+      compare(out_ptr[i] / float(height * width), in_ptr[i]);
+    }
+  }
+
+  SECTION("FP32 in-place with padded rows") {
+    const size_t paddedWidth = 2 * complexWidth;
+    const size_t paddedSize = height * paddedWidth * sizeof(cufftReal);
+
+    cu::HostMemory h_in(paddedSize);
+    cu::HostMemory h_out(paddedSize);
+    cu::DeviceMemory d_data(paddedSize);
+
+    memset(h_in, 0, paddedSize);
+    generateSignal(static_cast<cufftReal *>(h_in), height, paddedWidth,
+                   patchSize, 1.0f);
+    stream.memcpyHtoDAsync(d_data, h_in, paddedSize);
+
+    cufft::FFT2DR2C<CUDA_R_32F> fft_r2c{height, width, 1, paddedWidth,
+                                        complexWidth};
+    cufft::FFT2DC2R<CUDA_C_32F> fft_c2r{height, width, 1, complexWidth,
+                                        paddedWidth};
+    fft_r2c.setStream(stream);
+    fft_c2r.setStream(stream);
+
+    fft_r2c.execute(d_data, d_data, CUFFT_FORWARD);
+    fft_c2r.execute(d_data, d_data, CUFFT_INVERSE);
+    stream.memcpyDtoHAsync(h_out, d_data, paddedSize);
+    stream.synchronize();
+
+    cufftReal *in_ptr = static_cast<cufftReal *>(h_in);
+    cufftReal *out_ptr = static_cast<cufftReal *>(h_out);
+    for (size_t y = 0; y < height; y++) {
+      for (size_t x = 0; x < width; x++) {
+        const size_t i = y * paddedWidth + x;
+        compare(out_ptr[i] / float(height * width), in_ptr[i]);
+      }
+    }
+  }
+
+  SECTION("FP16") {
+    const size_t realSize = height * width * sizeof(half);
+    const size_t complexSize = height * complexWidth * sizeof(half2);
+
+    cu::HostMemory h_in(realSize);
+    cu::HostMemory h_out(realSize);
+    cu::DeviceMemory d_in(realSize);
+    cu::DeviceMemory d_out(complexSize);
+    cu::DeviceMemory d_out2(realSize);
+
+    generateSignal(static_cast<half *>(h_in), height, width, patchSize,
+                   half(0.1));
+    stream.memcpyHtoDAsync(d_in, h_in, realSize);
+
+    cufft::FFT2DR2C<CUDA_R_16F> fft_r2c{height, width};
+    cufft::FFT2DC2R<CUDA_C_16F> fft_c2r{height, width};
+    fft_r2c.setStream(stream);
+    fft_c2r.setStream(stream);
+
+    fft_r2c.execute(d_in, d_out, CUFFT_FORWARD);
+    fft_c2r.execute(d_out, d_out2, CUFFT_INVERSE);
+    stream.memcpyDtoHAsync(h_out, d_out2, realSize);
+    stream.synchronize();
+
+    half *in_ptr = static_cast<half *>(h_in);
+    half *out_ptr = static_cast<half *>(h_out);
+    for (size_t i = 0; i < height * width; i++) {
+      compare(__half2float(out_ptr[i]) / float(height * width),
+              __half2float(in_ptr[i]), FP16_EPSILON);
+    }
+  }
+
+  SECTION("Invalid padding") {
+    CHECK_THROWS(cufft::FFT2DR2C<CUDA_R_32F>(height, width, 1, width,
+                                             complexWidth - 1));
+    CHECK_THROWS(cufft::FFT2DC2R<CUDA_C_32F>(height, width, 1,
+                                             complexWidth - 1, width));
+  }
+}
+
+TEST_CASE("Test FFT bound to a stream", "[FFT]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+  cu::Stream stream;
+
+  const size_t size = 256;
+  const size_t patchSize = 10;
+  const size_t arraySize = size * sizeof(cufftComplex);
+
+  cu::HostMemory h_in(arraySize);
+  cu::HostMemory h_out(arraySize);
+  cu::DeviceMemory d_in(arraySize);
+  cu::DeviceMemory d_out(arraySize);
+  cu::DeviceMemory d_out2(arraySize);
+
+  generateSignal(static_cast<cufftComplex *>(h_in), size, patchSize, {1, 1});
+  stream.memcpyHtoDAsync(d_in, h_in, arraySize);
+
+  SECTION("Construct with stream") {
+    cufft::FFT1D<CUDA_C_32F> fft(stream, size);
+
+    fft.execute(d_in, d_out, CUFFT_FORWARD);
+    fft.execute(d_out, d_out2, CUFFT_INVERSE);
+  }
+
+  SECTION("Execute on stream with shared work area") {
+    cufft::FFT1D<CUDA_C_32F> fft_forward(size);
+    cufft::FFT1D<CUDA_C_32F> fft_inverse(size);
+    const size_t workSize =
+        std::max(fft_forward.getWorkSize(), fft_inverse.getWorkSize());
+    cu::DeviceMemory workArea(std::max(workSize, size_t(1)));
+    fft_forward.setWorkArea(workArea);
+    fft_inverse.setWorkArea(workArea);
+
+    fft_forward.execute(d_in, d_out, CUFFT_FORWARD, stream);
+    fft_inverse.execute(d_out, d_out2, CUFFT_INVERSE, stream);
+  }
+
+  stream.memcpyDtoHAsync(h_out, d_out2, arraySize);
+  stream.synchronize();
+
+  cuFloatComplex *in_ptr = static_cast<cuFloatComplex *>(h_in);
+  cuFloatComplex *out_ptr = static_cast<cuFloatComplex *>(h_out);
+  scaleSignal(out_ptr, out_ptr, size, float(size));
+  compare(out_ptr, in_ptr, size);
+}
@@ -0,0 +1,81 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <cudawrappers/cu.hpp>
+#include <cudawrappers/metrics.hpp>
+
+TEST_CASE("Test metrics::Exporter", "[exporter]") {
+  cu::init();
+  cu::Device device(0);
+  cu::Context context(CU_CTX_SCHED_BLOCKING_SYNC, device);
+
+  const std::array<int, 3> src = {1, 2, 3};
+  cu::DeviceMemory mem(sizeof(src));
+  cu::Stream stream;
+  stream.memcpyHtoDAsync(mem, src.data(), sizeof(src));
+  stream.synchronize();
+
+  metrics::Exporter exporter;
+
+  SECTION("Test Exporter::collect") {
+    const std::string metrics = exporter.collect();
+    CHECK(metrics.find("# TYPE cudawrappers_copied_bytes_total counter") !=
+          std::string::npos);
+    CHECK(metrics.find("cudawrappers_copied_bytes_total{direction=\"htod\"}") !=
+          std::string::npos);
+    CHECK(metrics.find("cudawrappers_synchronizations_total") !=
+          std::string::npos);
+    CHECK(metrics.find("cudawrappers_pool_hits_total") != std::string::npos);
+    CHECK(metrics.find("cudawrappers_deferred_bytes") != std::string::npos);
+#if !defined(__HIP_PLATFORM_AMD__)
+    CHECK(metrics.find("gpu_power_watts{device=\"0\"}") != std::string::npos);
+#endif
+  }
+
+  SECTION("Test Exporter::writeTextfile") {
+    const std::string path = "test_metrics.prom";
+    exporter.writeTextfile(path);
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    CHECK(contents.str().find("cudawrappers_kernel_launches_total") !=
+          std::string::npos);
+    std::remove(path.c_str());
+  }
+
+  SECTION("Test Exporter::listen") {
+    const unsigned short port = 19400;
+    exporter.listen(port);
+
+    const int client = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    REQUIRE(connect(client, reinterpret_cast<sockaddr *>(&address),
+                    sizeof(address)) == 0);
+    const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+    send(client, request.data(), request.size(), 0);
+
+    std::string response;
+    std::array<char, 4096> buffer;
+    ssize_t received;
+    while ((received = recv(client, buffer.data(), buffer.size(), 0)) > 0) {
+      response.append(buffer.data(), received);
+    }
+    close(client);
+
+    CHECK(response.find("HTTP/1.0 200 OK") == 0);
+    CHECK(response.find("cudawrappers_device_memory_bytes") !=
+          std::string::npos);
+  }
+}
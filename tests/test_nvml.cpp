@@ -1,5 +1,7 @@
 #include <catch2/catch_test_macros.hpp>
+#include <chrono>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <cudawrappers/cu.hpp>
@@ -33,3 +35,194 @@ TEST_CASE("Test nvml::Device with device", "[device]") {
   nvml::Context nvml_context;
   nvml::Device nvml_device(cu_device);
 }
+
+TEST_CASE("Test nvml::PowerSampler", "[sampler]") {
+  nvml::Context context;
+  nvml::Device device(0);
+  nvml::PowerSampler sampler(device, std::chrono::milliseconds(5));
+
+  SECTION("Test PowerSampler::read") {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const nvml::PowerSampler::Sample sample = sampler.read();
+    REQUIRE(sample.power > 0);
+    REQUIRE(sample.time > 0);
+  }
+
+  SECTION("Test PowerSampler regions") {
+    sampler.begin("outer");
+    sampler.begin("inner");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const nvml::PowerSampler::Region inner = sampler.end();
+    const nvml::PowerSampler::Region outer = sampler.end();
+
+    CHECK(inner.name == "inner");
+    CHECK(outer.name == "outer");
+    CHECK(inner.seconds > 0);
+    CHECK(outer.seconds >= inner.seconds);
+    CHECK(inner.watts > 0);
+    CHECK(inner.joules > 0);
+    CHECK(inner.samples > 0);
+    CHECK(sampler.regions().size() == 2);
+    CHECK_THROWS(sampler.end());
+  }
+}
+
+TEST_CASE("Test nvml::Context reference counting", "[context]") {
+  const size_t count = nvml::Context::getReferenceCount();
+  {
+    nvml::Context context;
+    nvml::Context copy(context);
+    CHECK(nvml::Context::getReferenceCount() == count + 2);
+    nvml::Device device(0);
+  }
+  CHECK(nvml::Context::getReferenceCount() == count);
+}
+
+TEST_CASE("Test nvml::Telemetry", "[telemetry]") {
+  nvml::Context context;
+  nvml::Device device(0);
+
+  SECTION("Test default metrics") {
+    nvml::Telemetry telemetry(device);
+    const nvml::Telemetry::Snapshot snapshot = telemetry.collect();
+    CHECK(snapshot.valid == telemetry.getMetrics());
+    REQUIRE(snapshot.has(nvml::Telemetry::clocks));
+    CHECK(snapshot.smClock > 0);
+    REQUIRE(snapshot.has(nvml::Telemetry::power));
+    CHECK(snapshot.power > 0);
+    REQUIRE(snapshot.has(nvml::Telemetry::memory));
+    CHECK(snapshot.memoryUsed <= snapshot.memoryTotal);
+    CHECK(!snapshot.has(nvml::Telemetry::pcie));
+  }
+
+  SECTION("Test selected metrics") {
+    nvml::Telemetry telemetry(device, nvml::Telemetry::power |
+                                          nvml::Telemetry::temperature);
+    const nvml::Telemetry::Snapshot snapshot = telemetry.collect();
+    CHECK(!snapshot.has(nvml::Telemetry::clocks));
+    CHECK(snapshot.has(nvml::Telemetry::power));
+  }
+}
+
+TEST_CASE("Test nvml::Device::getClockState", "[clocks]") {
+  nvml::Context context;
+  nvml::Device device(0);
+  const nvml::ClockState state = device.getClockState();
+  CHECK(state.graphics > 0);
+  CHECK(state.memory > 0);
+}
+
+TEST_CASE("Test nvml::ClockLock", "[clocks]") {
+  nvml::Context context;
+  nvml::Device device(0);
+
+  // Locking clocks requires root privileges and a supported device
+  try {
+    const nvml::ClockLock lock = nvml::ClockLock::lockBaseClocks(device);
+    const unsigned int clockMhz =
+        device.getDefaultApplicationsClock(NVML_CLOCK_GRAPHICS);
+    CHECK(device.getClockState().graphics <= clockMhz);
+    {
+      // A nested lock restores the outer lock
+      const nvml::ClockLock inner =
+          nvml::ClockLock::lockGpuClocks(device, clockMhz / 2, clockMhz);
+      CHECK(inner.getPreviousLock().locked);
+      CHECK(device.getLockedGpuClocks().minClockMhz == clockMhz / 2);
+    }
+    CHECK(device.getLockedGpuClocks().minClockMhz == clockMhz);
+  } catch (nvml::Error& error) {
+    const nvmlReturn_t result = error;
+    CHECK((result == NVML_ERROR_NO_PERMISSION ||
+           result == NVML_ERROR_NOT_SUPPORTED));
+  }
+}
+
+TEST_CASE("Test nvml::EnergyBenchmark", "[benchmark]") {
+  cu::init();
+  cu::Device cu_device(0);
+  cu::Context cu_context(CU_CTX_SCHED_BLOCKING_SYNC, cu_device);
+  nvml::Context context;
+  nvml::Device device(cu_device);
+
+  const size_t size = 64 * 1024 * 1024;
+  cu::DeviceMemory memory(size);
+  cu::Stream stream;
+
+  nvml::EnergyBenchmark::Options options;
+  options.window = std::chrono::milliseconds(50);
+  options.windows = 3;
+  options.lockClocks = true;
+  nvml::EnergyBenchmark benchmark(device, stream, options);
+
+  const nvml::EnergyBenchmark::Result result =
+      benchmark.run([&](cu::Stream& stream) {
+        stream.memsetAsync(memory, static_cast<unsigned char>(1), size);
+      });
+
+  CHECK(result.callsPerWindow > 0);
+  CHECK(result.seconds.mean > 0);
+  CHECK(result.seconds.confidence >= 0);
+  CHECK(result.joules.mean > 0);
+  CHECK(result.watts.mean > 0);
+  CHECK(result.callsPerJoule.mean > 0);
+  CHECK(result.clocks.graphics > 0);
+}
+
+TEST_CASE("Test nvml::DeviceLoadSource", "[deviceload]") {
+  cu::init();
+  cu::Device cu_device(0);
+  nvml::DeviceLoadSource source;
+
+  const cu::DeviceLoad load = source(0);
+  CHECK(load.totalMemory > 0);
+  CHECK(load.freeMemory <= load.totalMemory);
+  CHECK(load.utilization >= 0);
+  CHECK(load.utilization <= 1);
+
+  cu::DeviceSelector selector(cu::Device::getCount(), source);
+  CHECK(selector.select().getOrdinal() >= 0);
+}
+
+TEST_CASE("Test nvml::LinkMonitor", "[link]") {
+  cu::init();
+  cu::Device cu_device(0);
+  cu::Context cu_context(CU_CTX_SCHED_BLOCKING_SYNC, cu_device);
+  nvml::Context context;
+  nvml::Device device(cu_device);
+
+  SECTION("Test PCIe and NVLink counters") {
+    try {
+      CHECK(device.getPcieLinkGeneration() > 0);
+      CHECK(device.getPcieLinkWidth() > 0);
+      CHECK(device.getPcieBandwidth() > 0);
+    } catch (nvml::Error& error) {
+      const nvmlReturn_t result = error;
+      CHECK(result == NVML_ERROR_NOT_SUPPORTED);
+    }
+    unsigned long long tx, rx;
+    if (device.getNvLinkCount() > 0) {
+      CHECK_NOTHROW(device.getNvLinkThroughput(tx, rx));
+    }
+  }
+
+  SECTION("Test correlation with copies") {
+    const size_t size = 64 * 1024 * 1024;
+    cu::HostMemory h_memory(size);
+    cu::DeviceMemory d_memory(size);
+    cu::Stream stream;
+
+    nvml::LinkMonitor monitor(device);
+    monitor.begin();
+    for (int i = 0; i < 10; i++) {
+      stream.memcpyHtoDAsync(d_memory, h_memory, size);
+    }
+    stream.synchronize();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const nvml::LinkMonitor::Window window = monitor.end();
+
+    CHECK(window.seconds > 0);
+    CHECK(window.submittedHtoD == 10 * size);
+    CHECK(window.pcieRx >= 0);
+    CHECK(window.copyUtilizationHtoD >= 0);
+  }
+}